@@ -0,0 +1,55 @@
+#include "formats.hpp"
+
+namespace {
+double tag(value_shape shape)
+{
+  return static_cast<double>(shape);
+}
+}
+
+value_shape classify(dstree& t)
+{
+  const auto n = t.size();
+  if (!n)
+    return value_shape::null;
+  if (n == 1) {
+    auto child = t.nth_child(0);
+    auto k = child->data();
+    if (auto d = std::get_if<double>(&k)) {
+      for (auto shape : { value_shape::null, value_shape::false_value,
+                          value_shape::true_value, value_shape::scalar,
+                          value_shape::empty_array,
+                          value_shape::empty_object })
+        if (*d == tag(shape) &&
+            child->size() == (shape == value_shape::scalar ? 1u : 0u))
+          return shape;
+    }
+  }
+
+  // Children are ordered by key, so array indices come in sequence
+  auto res = value_shape::array;
+  int64_t i = 0;
+  t.for_each_child([&](dstree& child) {
+    auto k = child.data();
+    auto index = std::get_if<int64_t>(&k);
+    if (!index || *index != i++)
+      res = value_shape::object;
+  });
+  return res;
+}
+
+dstree::key scalar_value(dstree& t)
+{
+  return t.nth_child(0)->nth_child(0)->data();
+}
+
+void add_tagged(dstree::builder& out, value_shape shape, const dstree::key& k)
+{
+  if (shape != value_shape::scalar) {
+    out.add(tag(shape));
+    return;
+  }
+  out.open(tag(shape));
+  out.add(k);
+  out.close();
+}
@@ -0,0 +1,38 @@
+#pragma once
+#include "io.hpp"
+#include <dstree/dstree.hpp>
+
+// JSON and MessagePack documents map to the children of the root node:
+// - object members are children keyed by member name
+// - array elements are children keyed by index
+// - any other value is a single child keyed by the tag of its shape, a
+//   double and so never a member name or an index. Numbers and strings are
+//   a child of the tag without children.
+// MessagePack maps can't have floating point keys, maps keyed by 0 to n - 1
+// read back as arrays.
+dstree import_json(reader& in);
+void export_json(dstree& t, writer& out);
+
+dstree import_msgpack(reader& in);
+void export_msgpack(dstree& t, writer& out);
+
+// Shape of the value stored in the children of a node. Shapes up to
+// empty_object are tagged, a node without children is also taken for null.
+enum class value_shape
+{
+  null,
+  false_value,
+  true_value,
+  scalar,
+  empty_array,
+  empty_object,
+  array,
+  object,
+};
+value_shape classify(dstree& t);
+// Value of a tagged scalar
+dstree::key scalar_value(dstree& t);
+
+// Adds the child of a tagged value, scalar values need k
+void add_tagged(dstree::builder& out, value_shape shape,
+                const dstree::key& k = dstree::key());
@@ -0,0 +1,147 @@
+#pragma once
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Reads a file in fixed size chunks, so inputs larger than memory can be
+// parsed in one pass
+class reader
+{
+public:
+  explicit reader(const std::filesystem::path& p,
+                  size_t chunk_size = 1024 * 1024)
+    : f(p, std::ios_base::binary)
+    , buf(chunk_size)
+  {
+    if (!f)
+      throw std::runtime_error("unable to open " + p.string());
+  }
+
+  // Returns -1 at the end of the input
+  int peek()
+  {
+    if (pos == end && !refill())
+      return -1;
+    return static_cast<uint8_t>(buf[pos]);
+  }
+
+  int get()
+  {
+    auto c = peek();
+    if (c >= 0)
+      ++pos;
+    return c;
+  }
+
+  // Bytes already in memory, at least one unless the input is over
+  const char* data()
+  {
+    peek();
+    return buf.data() + pos;
+  }
+  size_t available()
+  {
+    peek();
+    return end - pos;
+  }
+  void skip(size_t n) { pos += n; }
+
+  void read(void* dst, size_t n)
+  {
+    auto out = static_cast<char*>(dst);
+    while (n) {
+      const auto k = std::min(n, available());
+      if (!k)
+        throw std::runtime_error("unexpected end of input");
+      memcpy(out, data(), k);
+      skip(k);
+      out += k;
+      n -= k;
+    }
+  }
+
+  uint64_t offset() const { return consumed + pos; }
+
+private:
+  bool refill()
+  {
+    consumed += end;
+    pos = end = 0;
+    f.read(buf.data(), buf.size());
+    end = static_cast<size_t>(f.gcount());
+    return end > 0;
+  }
+
+  std::ifstream f;
+  std::vector<char> buf;
+  size_t pos = 0, end = 0;
+  uint64_t consumed = 0;
+};
+
+// Collects output in a large buffer instead of going through the stream for
+// every token
+class writer
+{
+public:
+  explicit writer(std::ostream& os_, size_t buffer_size = 1024 * 1024)
+    : os(os_)
+  {
+    buf.reserve(buffer_size);
+  }
+  ~writer() { flush(); }
+
+  void put(char c)
+  {
+    if (buf.size() == buf.capacity())
+      flush();
+    buf.push_back(c);
+  }
+
+  void write(const char* p, size_t n)
+  {
+    if (buf.size() + n > buf.capacity())
+      flush();
+    if (n >= buf.capacity())
+      os.write(p, n);
+    else
+      buf.insert(buf.end(), p, p + n);
+  }
+
+  void write(const std::string& s) { write(s.data(), s.size()); }
+
+  void write_number(int64_t v)
+  {
+    char tmp[24];
+    write(tmp, std::to_chars(tmp, tmp + sizeof(tmp), v).ptr - tmp);
+  }
+
+  // Shortest text that reads back as the same double, always with a
+  // fraction or an exponent so it isn't taken for an integer
+  void write_number(double v)
+  {
+    char tmp[32];
+    auto end = std::to_chars(tmp, tmp + sizeof(tmp), v).ptr;
+    write(tmp, end - tmp);
+    if (std::find_if(tmp, end, [](char c) {
+          return c == '.' || c == 'e' || c == 'n' || c == 'i';
+        }) == end)
+      write(".0", 2);
+  }
+
+  void flush()
+  {
+    os.write(buf.data(), buf.size());
+    buf.clear();
+  }
+
+private:
+  std::ostream& os;
+  std::vector<char> buf;
+};
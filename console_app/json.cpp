@@ -0,0 +1,472 @@
+#include "formats.hpp"
+#include <cmath>
+
+#if defined(__SSE2__) || defined(_M_X64) ||                                  \
+  (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  include <emmintrin.h>
+#  define DSTREE_JSON_SSE2
+#endif
+#ifdef _MSC_VER
+#  include <intrin.h>
+#endif
+
+namespace {
+unsigned count_trailing_zeros(uint32_t x)
+{
+#ifdef _MSC_VER
+  unsigned long i;
+  _BitScanForward(&i, x);
+  return i;
+#else
+  return __builtin_ctz(x);
+#endif
+}
+
+// Length of the leading run of characters that can be copied to or from a
+// JSON string as is, i.e. anything but quotes, backslashes and control
+// characters. Checks 16 bytes at a time where SSE2 is available.
+size_t plain_run(const char* p, size_t n)
+{
+  size_t i = 0;
+#ifdef DSTREE_JSON_SSE2
+  const auto quote = _mm_set1_epi8('"');
+  const auto backslash = _mm_set1_epi8('\\');
+  const auto control = _mm_set1_epi8(0x1f);
+  for (; i + 16 <= n; i += 16) {
+    const auto x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+    const auto special = _mm_or_si128(
+      _mm_or_si128(_mm_cmpeq_epi8(x, quote), _mm_cmpeq_epi8(x, backslash)),
+      _mm_cmpeq_epi8(_mm_max_epu8(x, control), control));
+    if (const auto mask = _mm_movemask_epi8(special))
+      return i + count_trailing_zeros(static_cast<uint32_t>(mask));
+  }
+#endif
+  for (; i < n; ++i) {
+    const auto c = static_cast<uint8_t>(p[i]);
+    if (c == '"' || c == '\\' || c < 0x20)
+      break;
+  }
+  return i;
+}
+
+class json_parser
+{
+public:
+  json_parser(reader& in_, dstree::builder& out_)
+    : in(in_)
+    , out(out_)
+  {
+  }
+
+  // Containers are tracked on an explicit stack, so nesting depth is only
+  // limited by memory
+  void parse()
+  {
+    enum class state
+    {
+      value,
+      member,
+      after_value,
+      done
+    };
+    struct frame
+    {
+      bool object;
+      int64_t index;
+    };
+    std::vector<frame> stack;
+
+    auto st = state::value;
+    while (st != state::done) {
+      switch (st) {
+        case state::value: {
+          const auto c = skip_whitespace();
+          if (c == '{') {
+            in.get();
+            if (skip_whitespace() == '}') {
+              in.get();
+              add_tagged(out, value_shape::empty_object);
+              st = state::after_value;
+            } else {
+              stack.push_back({ true, 0 });
+              st = state::member;
+            }
+          } else if (c == '[') {
+            in.get();
+            if (skip_whitespace() == ']') {
+              in.get();
+              add_tagged(out, value_shape::empty_array);
+              st = state::after_value;
+            } else {
+              stack.push_back({ false, 0 });
+              out.open(int64_t(0));
+            }
+          } else {
+            parse_scalar();
+            st = state::after_value;
+          }
+          break;
+        }
+        case state::member:
+          expect(skip_whitespace(), '"');
+          in.get();
+          parse_string();
+          expect(skip_whitespace(), ':');
+          in.get();
+          out.open(str.c_str());
+          st = state::value;
+          break;
+        case state::after_value: {
+          if (stack.empty()) {
+            st = state::done;
+            break;
+          }
+          out.close();
+          auto& top = stack.back();
+          const auto c = skip_whitespace();
+          in.get();
+          if (c == ',') {
+            if (top.object) {
+              st = state::member;
+            } else {
+              out.open(++top.index);
+              st = state::value;
+            }
+          } else {
+            expect(c, top.object ? '}' : ']');
+            stack.pop_back();
+          }
+          break;
+        }
+        case state::done:
+          break;
+      }
+    }
+
+    if (skip_whitespace() != -1)
+      error("unexpected trailing characters");
+  }
+
+private:
+  [[noreturn]] void error(const char* what)
+  {
+    throw std::runtime_error(std::string("json: ") + what + " at offset " +
+                             std::to_string(in.offset()));
+  }
+
+  void expect(int c, char expected)
+  {
+    if (c != expected)
+      error(c == -1 ? "unexpected end of input" : "unexpected character");
+  }
+
+  int skip_whitespace()
+  {
+    while (1) {
+      const auto c = in.peek();
+      if (c != ' ' && c != '\n' && c != '\r' && c != '\t')
+        return c;
+      in.get();
+    }
+  }
+
+  void parse_scalar()
+  {
+    const auto c = in.peek();
+    if (c == '"') {
+      in.get();
+      parse_string();
+      add_tagged(out, value_shape::scalar, str.c_str());
+    } else if (c == 't') {
+      parse_literal("true");
+      add_tagged(out, value_shape::true_value);
+    } else if (c == 'f') {
+      parse_literal("false");
+      add_tagged(out, value_shape::false_value);
+    } else if (c == 'n') {
+      parse_literal("null");
+      add_tagged(out, value_shape::null);
+    } else if (c == '-' || (c >= '0' && c <= '9')) {
+      parse_number();
+    } else {
+      expect(c, '"');
+    }
+  }
+
+  void parse_literal(const char* literal)
+  {
+    for (auto p = literal; *p; ++p)
+      expect(in.get(), *p);
+  }
+
+  void parse_number()
+  {
+    char tmp[64];
+    size_t n = 0;
+    bool integer = true;
+    while (1) {
+      const auto c = in.peek();
+      if (c == '.' || c == 'e' || c == 'E')
+        integer = false;
+      else if (c != '-' && c != '+' && (c < '0' || c > '9'))
+        break;
+      if (n == sizeof(tmp))
+        error("number is too long");
+      tmp[n++] = static_cast<char>(in.get());
+    }
+
+    int64_t i;
+    if (integer) {
+      auto res = std::from_chars(tmp, tmp + n, i);
+      if (res.ec == std::errc() && res.ptr == tmp + n) {
+        add_tagged(out, value_shape::scalar, i);
+        return;
+      }
+    }
+
+    // Integers out of the int64_t range are kept as doubles
+    double d;
+    auto res = std::from_chars(tmp, tmp + n, d);
+    if (res.ec != std::errc() || res.ptr != tmp + n)
+      error("invalid number");
+    add_tagged(out, value_shape::scalar, d);
+  }
+
+  // Reads the rest of a string after the opening quote into str
+  void parse_string()
+  {
+    str.clear();
+    while (1) {
+      const auto n = plain_run(in.data(), in.available());
+      str.append(in.data(), n);
+      in.skip(n);
+
+      const auto c = in.get();
+      if (c == '"')
+        return;
+      if (c == '\\')
+        parse_escape();
+      else if (c == -1)
+        error("unexpected end of input");
+      else if (c < 0x20)
+        error("control character in string");
+    }
+  }
+
+  void parse_escape()
+  {
+    const auto c = in.get();
+    switch (c) {
+      case '"':
+      case '\\':
+      case '/':
+        str += static_cast<char>(c);
+        break;
+      case 'b':
+        str += '\b';
+        break;
+      case 'f':
+        str += '\f';
+        break;
+      case 'n':
+        str += '\n';
+        break;
+      case 'r':
+        str += '\r';
+        break;
+      case 't':
+        str += '\t';
+        break;
+      case 'u': {
+        auto cp = parse_hex4();
+        if (cp >= 0xd800 && cp < 0xdc00) {
+          expect(in.get(), '\\');
+          expect(in.get(), 'u');
+          const auto low = parse_hex4();
+          if (low < 0xdc00 || low >= 0xe000)
+            error("invalid surrogate pair");
+          cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+        }
+        append_utf8(cp);
+        break;
+      }
+      default:
+        error("invalid escape");
+    }
+  }
+
+  uint32_t parse_hex4()
+  {
+    uint32_t res = 0;
+    for (int i = 0; i < 4; ++i) {
+      const auto c = in.get();
+      res <<= 4;
+      if (c >= '0' && c <= '9')
+        res |= c - '0';
+      else if (c >= 'a' && c <= 'f')
+        res |= c - 'a' + 10;
+      else if (c >= 'A' && c <= 'F')
+        res |= c - 'A' + 10;
+      else
+        error("invalid unicode escape");
+    }
+    return res;
+  }
+
+  void append_utf8(uint32_t cp)
+  {
+    if (cp < 0x80) {
+      str += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+      str += static_cast<char>(0xc0 | (cp >> 6));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    } else if (cp < 0x10000) {
+      str += static_cast<char>(0xe0 | (cp >> 12));
+      str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    } else {
+      str += static_cast<char>(0xf0 | (cp >> 18));
+      str += static_cast<char>(0x80 | ((cp >> 12) & 0x3f));
+      str += static_cast<char>(0x80 | ((cp >> 6) & 0x3f));
+      str += static_cast<char>(0x80 | (cp & 0x3f));
+    }
+  }
+
+  reader& in;
+  dstree::builder& out;
+  std::string str;
+};
+
+void write_string(const char* s, writer& out)
+{
+  static const char hex[] = "0123456789abcdef";
+  out.put('"');
+  for (auto n = strlen(s); n;) {
+    const auto k = plain_run(s, n);
+    out.write(s, k);
+    s += k;
+    n -= k;
+    if (!n)
+      break;
+
+    const auto c = static_cast<uint8_t>(*s++);
+    --n;
+    out.put('\\');
+    if (c == '"' || c == '\\') {
+      out.put(static_cast<char>(c));
+    } else if (c == '\n') {
+      out.put('n');
+    } else if (c == '\t') {
+      out.put('t');
+    } else if (c == '\r') {
+      out.put('r');
+    } else {
+      const char esc[] = { 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+      out.write(esc, sizeof(esc));
+    }
+  }
+  out.put('"');
+}
+
+void write_key(const dstree::key& k, writer& out)
+{
+  if (auto i = std::get_if<int64_t>(&k)) {
+    out.write_number(*i);
+  } else if (auto d = std::get_if<double>(&k)) {
+    // JSON has no NaN and infinities
+    if (std::isfinite(*d))
+      out.write_number(*d);
+    else
+      out.write("null", 4);
+  } else {
+    write_string(std::get<const char*>(k), out);
+  }
+}
+
+// Object member names are always strings
+void write_member_name(const dstree::key& k, writer& out)
+{
+  if (auto s = std::get_if<const char*>(&k)) {
+    write_string(*s, out);
+  } else {
+    out.put('"');
+    write_key(k, out);
+    out.put('"');
+  }
+}
+
+// A single walk over the tree, so the depth of the document isn't limited
+// by the stack. Containers are closed once the walk leaves them.
+void write_value(dstree& t, writer& out)
+{
+  struct container
+  {
+    bool object;
+    size_t depth;
+    size_t size;
+  };
+  std::vector<container> open;
+  auto close = [&](size_t depth) {
+    while (!open.empty() && open.back().depth >= depth) {
+      out.put(open.back().object ? '}' : ']');
+      open.pop_back();
+    }
+  };
+
+  t.walk([&](dstree& node, size_t depth) {
+    close(depth);
+    if (depth) {
+      auto& parent = open.back();
+      if (parent.size++)
+        out.put(',');
+      if (parent.object) {
+        write_member_name(node.data(), out);
+        out.put(':');
+      }
+    }
+    switch (classify(node)) {
+      case value_shape::null:
+        out.write("null", 4);
+        return false;
+      case value_shape::false_value:
+        out.write("false", 5);
+        return false;
+      case value_shape::true_value:
+        out.write("true", 4);
+        return false;
+      case value_shape::scalar:
+        write_key(scalar_value(node), out);
+        return false;
+      case value_shape::empty_array:
+        out.write("[]", 2);
+        return false;
+      case value_shape::empty_object:
+        out.write("{}", 2);
+        return false;
+      case value_shape::array:
+        out.put('[');
+        open.push_back({ false, depth, 0 });
+        return true;
+      case value_shape::object:
+        out.put('{');
+        open.push_back({ true, depth, 0 });
+        return true;
+    }
+    return false;
+  });
+  close(0);
+}
+}
+
+dstree import_json(reader& in)
+{
+  dstree::builder builder;
+  json_parser(in, builder).parse();
+  return builder.finish();
+}
+
+void export_json(dstree& t, writer& out)
+{
+  write_value(t, out);
+  out.put('\n');
+}
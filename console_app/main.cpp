@@ -1,25 +1,47 @@
+#include "formats.hpp"
 #include <dstree/dstree.hpp>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
-#include <sstream>
 #include <string>
 
-std::string str(const dstree::key& k)
+enum class format
 {
-  std::stringstream ss;
-  std::visit([&ss](const auto& concrete) { ss << concrete; }, k);
-  return ss.str();
+  dstree,
+  json,
+  msgpack,
+};
+
+format parse_format(const char* name)
+{
+  if (!strcmp(name, "dstree"))
+    return format::dstree;
+  if (!strcmp(name, "json"))
+    return format::json;
+  if (!strcmp(name, "msgpack"))
+    return format::msgpack;
+  throw std::runtime_error(std::string("unknown format ") + name);
+}
+
+void write_key(const dstree::key& k, writer& out)
+{
+  if (auto i = std::get_if<int64_t>(&k))
+    out.write_number(*i);
+  else if (auto d = std::get_if<double>(&k))
+    out.write_number(*d);
+  else
+    out.write(std::get<const char*>(k), strlen(std::get<const char*>(k)));
 }
 
-void print_tree(dstree& t, uint32_t depth = 1)
+void print_tree(dstree& t, writer& out)
 {
-  for (uint32_t i = 0; i < depth; ++i)
-    std::cout << "-- ";
-  std::cout << str(t.data()) << std::endl;
-  depth++;
-  t.for_each_child([depth](dstree& child) { print_tree(child, depth); });
-  depth--;
+  t.walk([&out](dstree& node, size_t depth) {
+    for (size_t i = 0; i <= depth; ++i)
+      out.write("-- ", 3);
+    write_key(node.data(), out);
+    out.put('\n');
+    return true;
+  });
 }
 
 std::vector<uint8_t> read_file(const std::filesystem::path& p)
@@ -30,64 +52,87 @@ std::vector<uint8_t> read_file(const std::filesystem::path& p)
                               std::istreambuf_iterator<char>());
 }
 
-int main(int argc, char* argv[])
+int run(int argc, char* argv[])
 {
   const char *arg_i = "", *arg_o = "";
-  bool parsing_i = false, parsing_o = false;
-  for (int i = 0; i < argc; ++i) {
-    if (parsing_i) {
-      parsing_i = false;
-      arg_i = argv[i];
-    } else if (parsing_o) {
-      parsing_o = false;
-      arg_o = argv[i];
-    } else if (!strcmp(argv[i], "-i"))
-      parsing_i = true;
-    else if (!strcmp(argv[i], "-o"))
-      parsing_o = true;
+  auto input_format = format::dstree, output_format = format::dstree;
+  bool quiet = false;
+  for (int i = 1; i < argc; ++i) {
+    const bool has_value = i + 1 < argc;
+    if (!strcmp(argv[i], "-i") && has_value)
+      arg_i = argv[++i];
+    else if (!strcmp(argv[i], "-o") && has_value)
+      arg_o = argv[++i];
+    else if (!strcmp(argv[i], "-if") && has_value)
+      input_format = parse_format(argv[++i]);
+    else if (!strcmp(argv[i], "-of") && has_value)
+      output_format = parse_format(argv[++i]);
+    else if (!strcmp(argv[i], "-q"))
+      quiet = true;
   }
 
-  std::cout << "Input file: " << arg_i << std::endl;
-  std::cout << "Output file: " << arg_o << std::endl;
-  std::cout << std::endl;
+  writer console(std::cout);
+  auto log = [&](const std::string& line) {
+    if (!quiet) {
+      console.write(line);
+      console.put('\n');
+    }
+  };
 
-  std::vector<uint8_t> content;
-  if (arg_i[0]) {
-    content = read_file(arg_i);
-  } else {
-    std::cout << "No input file specified, using sample data" << std::endl;
-    dstree t;
+  log(std::string("Input file: ") + arg_i);
+  log(std::string("Output file: ") + arg_o);
+  log("");
+
+  dstree t;
+  if (!arg_i[0]) {
+    log("No input file specified, using sample data");
     t.set_data(8LL);
     t.insert(2.015);
     t.insert(1000LL);
     t.find(1000LL).insert(2000LL);
     t.find(1000LL).insert("abcd");
-    content.resize(t.serialize(nullptr, 0));
-    t.serialize(content.data(), content.size());
+  } else if (input_format == format::json) {
+    reader in(arg_i);
+    t = import_json(in);
+  } else if (input_format == format::msgpack) {
+    reader in(arg_i);
+    t = import_msgpack(in);
+  } else {
+    auto content = read_file(arg_i);
+    if (!content.empty())
+      t = dstree::deserialize(content.data(), content.size());
   }
 
-  auto t = content.empty()
-    ? dstree()
-    : dstree::deserialize(content.data(), content.size());
-
-  std::cout << std::endl;
-  std::cout << "Tree contents:" << std::endl;
-  print_tree(t);
-  std::cout << std::endl;
+  if (!quiet) {
+    log("");
+    log("Tree contents:");
+    print_tree(t, console);
+    log("");
+  }
 
   if (arg_o[0]) {
     std::ofstream f(arg_o, std::ios::binary);
-
-    std::vector<uint8_t> data(t.serialize(nullptr, 0));
-    t.serialize(data.data(), data.size());
-    f.write(reinterpret_cast<const char*>(data.data()), data.size());
-    std::cout << "Written to " << arg_o << std::endl;
+    writer out(f);
+    if (output_format == format::json) {
+      export_json(t, out);
+    } else if (output_format == format::msgpack) {
+      export_msgpack(t, out);
+    } else {
+      std::vector<uint8_t> data(t.serialize(nullptr, 0));
+      t.serialize(data.data(), data.size());
+      out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    }
+    log(std::string("Written to ") + arg_o);
   } else {
-    std::cout << "No output file specified" << std::endl;
+    log("No output file specified");
   }
+  return 0;
+}
 
+int main(int argc, char* argv[])
+{
   try {
-    return 0;
+    return run(argc, argv);
   } catch (std::exception& e) {
     std::cerr << e.what() << std::endl;
     return -1;
@@ -0,0 +1,343 @@
+#include "formats.hpp"
+
+namespace {
+template <class T>
+T read_big_endian(reader& in)
+{
+  uint8_t bytes[sizeof(T)];
+  in.read(bytes, sizeof(T));
+  uint64_t v = 0;
+  for (auto b : bytes)
+    v = (v << 8) | b;
+  T res;
+  if constexpr (sizeof(T) == sizeof(v)) {
+    memcpy(&res, &v, sizeof(res));
+  } else {
+    auto narrow = static_cast<std::conditional_t<
+      sizeof(T) == 4, uint32_t,
+      std::conditional_t<sizeof(T) == 2, uint16_t, uint8_t>>>(v);
+    memcpy(&res, &narrow, sizeof(res));
+  }
+  return res;
+}
+
+template <class T>
+void write_big_endian(T value, writer& out)
+{
+  uint8_t bytes[sizeof(T)];
+  uint64_t v = 0;
+  memcpy(&v, &value, sizeof(T));
+  for (size_t i = 0; i < sizeof(T); ++i)
+    bytes[i] = static_cast<uint8_t>(v >> (8 * (sizeof(T) - 1 - i)));
+  out.write(reinterpret_cast<const char*>(bytes), sizeof(T));
+}
+
+struct item
+{
+  enum class type
+  {
+    nil,
+    boolean,
+    scalar,
+    array,
+    map
+  };
+
+  type t = type::nil;
+  dstree::key k;
+  uint64_t size = 0;
+};
+
+class msgpack_parser
+{
+public:
+  msgpack_parser(reader& in_, dstree::builder& out_)
+    : in(in_)
+    , out(out_)
+  {
+  }
+
+  void parse()
+  {
+    struct frame
+    {
+      bool map;
+      uint64_t remaining;
+      int64_t index;
+    };
+    std::vector<frame> stack;
+
+    bool expecting_key = false;
+    while (1) {
+      if (expecting_key) {
+        const auto key = read_item();
+        // Floating point keys would be taken for tags
+        if ((key.t != item::type::scalar && key.t != item::type::boolean) ||
+            std::holds_alternative<double>(key.k))
+          error("map keys must be integers or strings");
+        out.open(key.k);
+        expecting_key = false;
+      }
+
+      const auto value = read_item();
+      bool container_done = true;
+      if (value.t == item::type::scalar) {
+        add_tagged(out, value_shape::scalar, value.k);
+      } else if (value.t == item::type::boolean) {
+        add_tagged(out, std::get<int64_t>(value.k) ? value_shape::true_value
+                                                   : value_shape::false_value);
+      } else if (value.t == item::type::nil) {
+        add_tagged(out, value_shape::null);
+      } else if (!value.size) {
+        add_tagged(out, value.t == item::type::map ? value_shape::empty_object
+                                                   : value_shape::empty_array);
+      } else {
+        stack.push_back({ value.t == item::type::map, value.size, 0 });
+        if (value.t == item::type::map)
+          expecting_key = true;
+        else
+          out.open(int64_t(0));
+        container_done = false;
+      }
+      if (!container_done)
+        continue;
+
+      // Closes the nodes of every container the value has completed
+      while (!stack.empty()) {
+        out.close();
+        auto& top = stack.back();
+        if (--top.remaining) {
+          if (top.map)
+            expecting_key = true;
+          else
+            out.open(++top.index);
+          break;
+        }
+        stack.pop_back();
+      }
+      if (stack.empty())
+        break;
+    }
+
+    if (in.peek() != -1)
+      error("unexpected trailing bytes");
+  }
+
+private:
+  [[noreturn]] void error(const char* what)
+  {
+    throw std::runtime_error(std::string("msgpack: ") + what +
+                             " at offset " + std::to_string(in.offset()));
+  }
+
+  item read_item()
+  {
+    const auto c = in.get();
+    if (c == -1)
+      error("unexpected end of input");
+
+    item res;
+    res.t = item::type::scalar;
+    if (c <= 0x7f) {
+      res.k = int64_t(c);
+    } else if (c <= 0x8f) {
+      res.t = item::type::map;
+      res.size = c & 0x0f;
+    } else if (c <= 0x9f) {
+      res.t = item::type::array;
+      res.size = c & 0x0f;
+    } else if (c <= 0xbf) {
+      res.k = read_string(c & 0x1f);
+    } else if (c >= 0xe0) {
+      res.k = int64_t(static_cast<int8_t>(c));
+    } else {
+      switch (c) {
+        case 0xc0:
+          res.t = item::type::nil;
+          break;
+        case 0xc2:
+        case 0xc3:
+          res.t = item::type::boolean;
+          res.k = int64_t(c == 0xc3);
+          break;
+        case 0xca:
+          res.k = double(read_big_endian<float>(in));
+          break;
+        case 0xcb:
+          res.k = read_big_endian<double>(in);
+          break;
+        case 0xcc:
+          res.k = int64_t(read_big_endian<uint8_t>(in));
+          break;
+        case 0xcd:
+          res.k = int64_t(read_big_endian<uint16_t>(in));
+          break;
+        case 0xce:
+          res.k = int64_t(read_big_endian<uint32_t>(in));
+          break;
+        case 0xcf: {
+          // Integers out of the int64_t range are kept as doubles
+          const auto v = read_big_endian<uint64_t>(in);
+          if (v > static_cast<uint64_t>(INT64_MAX))
+            res.k = double(v);
+          else
+            res.k = int64_t(v);
+          break;
+        }
+        case 0xd0:
+          res.k = int64_t(read_big_endian<int8_t>(in));
+          break;
+        case 0xd1:
+          res.k = int64_t(read_big_endian<int16_t>(in));
+          break;
+        case 0xd2:
+          res.k = int64_t(read_big_endian<int32_t>(in));
+          break;
+        case 0xd3:
+          res.k = read_big_endian<int64_t>(in);
+          break;
+        case 0xd9:
+          res.k = read_string(read_big_endian<uint8_t>(in));
+          break;
+        case 0xda:
+          res.k = read_string(read_big_endian<uint16_t>(in));
+          break;
+        case 0xdb:
+          res.k = read_string(read_big_endian<uint32_t>(in));
+          break;
+        case 0xdc:
+          res.t = item::type::array;
+          res.size = read_big_endian<uint16_t>(in);
+          break;
+        case 0xdd:
+          res.t = item::type::array;
+          res.size = read_big_endian<uint32_t>(in);
+          break;
+        case 0xde:
+          res.t = item::type::map;
+          res.size = read_big_endian<uint16_t>(in);
+          break;
+        case 0xdf:
+          res.t = item::type::map;
+          res.size = read_big_endian<uint32_t>(in);
+          break;
+        default:
+          error("binary and extension types are not supported");
+      }
+    }
+    return res;
+  }
+
+  // The key points into str, which stays valid until the next string
+  const char* read_string(uint32_t n)
+  {
+    str.resize(n);
+    in.read(str.data(), n);
+    return str.c_str();
+  }
+
+  reader& in;
+  dstree::builder& out;
+  std::string str;
+};
+
+void write_size(uint64_t n, uint8_t fix, uint8_t fix_limit, uint8_t code16,
+                writer& out)
+{
+  if (n < fix_limit) {
+    out.put(static_cast<char>(fix | n));
+  } else if (n <= 0xffff) {
+    out.put(static_cast<char>(code16));
+    write_big_endian(static_cast<uint16_t>(n), out);
+  } else {
+    out.put(static_cast<char>(code16 + 1));
+    write_big_endian(static_cast<uint32_t>(n), out);
+  }
+}
+
+void write_key(const dstree::key& k, writer& out)
+{
+  if (auto i = std::get_if<int64_t>(&k)) {
+    if (*i >= 0 && *i <= 0x7f) {
+      out.put(static_cast<char>(*i));
+    } else if (*i < 0 && *i >= -32) {
+      out.put(static_cast<char>(*i));
+    } else if (*i >= INT32_MIN && *i <= INT32_MAX) {
+      out.put(static_cast<char>(0xd2));
+      write_big_endian(static_cast<int32_t>(*i), out);
+    } else {
+      out.put(static_cast<char>(0xd3));
+      write_big_endian(*i, out);
+    }
+  } else if (auto d = std::get_if<double>(&k)) {
+    out.put(static_cast<char>(0xcb));
+    write_big_endian(*d, out);
+  } else {
+    auto s = std::get<const char*>(k);
+    const auto n = strlen(s);
+    if (n < 32) {
+      out.put(static_cast<char>(0xa0 | n));
+    } else if (n <= 0xff) {
+      out.put(static_cast<char>(0xd9));
+      out.put(static_cast<char>(n));
+    } else {
+      write_size(n, 0, 0, 0xda, out);
+    }
+    out.write(s, n);
+  }
+}
+
+// A single walk over the tree, so the depth of the document isn't limited
+// by the stack. Containers are prefixed with their sizes and need no end.
+void write_value(dstree& t, writer& out)
+{
+  // Whether the container at each depth of the walk is an object
+  std::vector<bool> objects;
+  t.walk([&](dstree& node, size_t depth) {
+    if (depth && objects[depth - 1])
+      write_key(node.data(), out);
+    objects.resize(depth);
+    switch (classify(node)) {
+      case value_shape::null:
+        out.put(static_cast<char>(0xc0));
+        return false;
+      case value_shape::false_value:
+        out.put(static_cast<char>(0xc2));
+        return false;
+      case value_shape::true_value:
+        out.put(static_cast<char>(0xc3));
+        return false;
+      case value_shape::scalar:
+        write_key(scalar_value(node), out);
+        return false;
+      case value_shape::empty_array:
+        out.put(static_cast<char>(0x90));
+        return false;
+      case value_shape::empty_object:
+        out.put(static_cast<char>(0x80));
+        return false;
+      case value_shape::array:
+        write_size(node.size(), 0x90, 16, 0xdc, out);
+        objects.push_back(false);
+        return true;
+      case value_shape::object:
+        write_size(node.size(), 0x80, 16, 0xde, out);
+        objects.push_back(true);
+        return true;
+    }
+    return false;
+  });
+}
+}
+
+dstree import_msgpack(reader& in)
+{
+  dstree::builder builder;
+  msgpack_parser(in, builder).parse();
+  return builder.finish();
+}
+
+void export_msgpack(dstree& t, writer& out)
+{
+  write_value(t, out);
+}
@@ -1,7 +1,19 @@
+#pragma once
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <memory_resource>
+#include <optional>
+#include <string>
 #include <variant>
+#include <vector>
+
+namespace dstree_ {
+struct tables;
+struct dictionary_data;
+}
+template <class... Levels>
+class typed_view;
 
 class dstree
 {
@@ -14,27 +26,299 @@ public:
   using key = std::variant<int64_t, double, const char*>;
   using for_each_callback = std::function<void(dstree&)>;
 
+  enum class huge_page_mode
+  {
+    none,
+    transparent,
+    hugetlb,
+  };
+  enum class numa_policy
+  {
+    none,
+    bind,
+    interleave,
+  };
+  struct placement_options
+  {
+    huge_page_mode huge_pages = huge_page_mode::transparent;
+    numa_policy numa = numa_policy::none;
+    uint64_t numa_nodes = 0;
+    size_t min_mapping_size = 1024 * 1024;
+  };
+  static std::unique_ptr<std::pmr::memory_resource> make_placement_resource(
+    const placement_options& options,
+    std::pmr::memory_resource* upstream = std::pmr::get_default_resource());
+
+  struct table_stats
+  {
+    uint64_t capacity = 0;
+    uint64_t used = 0;
+    uint64_t bytes = 0;
+  };
+  struct tree_stats
+  {
+    uint64_t total_bytes = 0;
+    table_stats nodes;
+    table_stats childs;
+    uint64_t allocated_childs = 0;
+    uint64_t wasted_childs = 0;
+    table_stats strings;
+    uint64_t dead_string_bytes = 0;
+    uint64_t extra_tables_bytes = 0;
+    uint32_t node_array_growth_factor = 0;
+    uint32_t childs_array_growth_factor = 0;
+  };
+
+  struct operation_stats
+  {
+    const char* name = "";
+    uint64_t count = 0;
+    uint64_t total_ns = 0;
+    uint64_t latency_histogram[32] = {};
+  };
+  using instrumentation_callback =
+    std::function<void(const operation_stats&)>;
+  static void export_instrumentation(const instrumentation_callback& callback);
+  static void reset_instrumentation();
+
+  enum class diff_kind
+  {
+    added,
+    removed,
+    value_changed,
+  };
+  // Added nodes have no lhs, removed nodes have no rhs
+  using diff_callback =
+    std::function<void(diff_kind kind, dstree* lhs, dstree* rhs)>;
+  static bool equal(const dstree& lhs, const dstree& rhs);
+  static void diff(const dstree& lhs, const dstree& rhs,
+                   const diff_callback& callback);
+
+  // Builds a tree from nodes added in preorder with a single layout pass at
+  // the end, much faster than insert for large trees
+  class builder
+  {
+  public:
+    explicit builder(
+      const key& data = key(),
+      std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+    builder(builder&& other) noexcept;
+    builder& operator=(builder&& other) noexcept;
+    ~builder();
+
+    // Adds a child to the current node and makes it current
+    void open(const key& k);
+    void close();
+    // Adds a child without children to the current node
+    void add(const key& k);
+    size_t depth() const;
+    dstree finish();
+
+  private:
+    struct state;
+    std::unique_ptr<state> s;
+  };
+
+  // Makes a tree with the given root key whose children are the parts,
+  // which must be root nodes. Their tables are copied side by side and
+  // relocated on several threads, zero threads means one per core.
+  static dstree join(
+    const key& root, const std::vector<dstree>& parts, size_t threads = 0,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+  // Calls build for every part on worker threads, each typically filling a
+  // builder of its own, and joins the resulting trees
+  using part_callback = std::function<dstree(size_t part)>;
+  static dstree build_parallel(
+    const key& root, size_t parts, const part_callback& build,
+    size_t threads = 0,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+
+  // Immutable sorted set of strings shared by many trees. Trees that use a
+  // dictionary store its strings as ids and record the dictionary id, so the
+  // dictionary must stay loaded while such trees are deserialized or used.
+  // Dictionaries with equal contents are the same object.
+  class dictionary
+  {
+  public:
+    static std::shared_ptr<const dictionary> create(
+      std::vector<std::string> strings);
+    static std::shared_ptr<const dictionary> deserialize(
+      const uint8_t* binary, size_t length);
+    // Loaded dictionary with the id, null if there is none
+    static std::shared_ptr<const dictionary> find(uint64_t id);
+    ~dictionary();
+
+    size_t serialize(uint8_t* buf, size_t buf_size) const;
+    uint64_t id() const;
+    size_t size() const;
+
+  private:
+    friend class dstree;
+    dictionary();
+
+    std::unique_ptr<dstree_::dictionary_data> s;
+  };
+
+  // Records changes of an owning tree and applies them on commit with one
+  // sort per touched child range and one growth per table. If commit throws
+  // the tree is left unchanged and the changes stay recorded. Changes that
+  // weren't committed are discarded on destruction.
+  class batch
+  {
+  public:
+    explicit batch(const dstree& tree);
+    batch(batch&& other) noexcept;
+    batch& operator=(batch&& other) noexcept;
+    ~batch();
+
+    // Returns the index of the new node in the result of commit, which may
+    // be used as the parent of later inserts
+    size_t insert(const dstree& parent, const key& k);
+    size_t insert(size_t parent, const key& k);
+    void erase(const dstree& node);
+    void set_data(const dstree& node, const key& k);
+    size_t size() const;
+
+    // Returns the inserted nodes
+    std::vector<dstree> commit();
+    void rollback();
+
+  private:
+    struct state;
+    std::unique_ptr<state> s;
+  };
+
   dstree();
   explicit dstree(const key& data);
+  dstree(const key& data, std::pmr::memory_resource* resource);
+  // Scratch trees take their buffer from a pool of the calling thread and
+  // return it to the pool of the thread that drops the last handle, so
+  // short-lived trees don't regrow their tables from scratch
+  static dstree scratch(const key& data = key());
+  // Adds buffers of the given capacity to the pool of the calling thread
+  static void reserve_scratch(size_t count, size_t bytes);
+  dstree(const dstree& other);
+  dstree(dstree&& other) = default;
+  dstree& operator=(const dstree& other);
+  dstree& operator=(dstree&& other) = default;
 
-  static dstree deserialize(const uint8_t* binary, size_t length,
-                            owning_mode m = owning_mode::owning);
+  static dstree deserialize(
+    const uint8_t* binary, size_t length, owning_mode m = owning_mode::owning,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
   size_t serialize(uint8_t* buf, size_t buf_size);
+  // Converts a serialized tree of an older version to the current layout in
+  // place, with one pass over its tables. Older trees can also be
+  // deserialized as they are: owning mode upgrades the copy and non_owning
+  // mode reads the old layout without changing it.
+  static void upgrade(uint8_t* binary, size_t length);
+  dstree replicate(std::pmr::memory_resource* resource);
+  // Stores strings of the tree found in the dictionary as its ids, now and
+  // on later changes. Null stores them in the tree again.
+  void use_dictionary(std::shared_ptr<const dictionary> d);
+
+  struct file_options
+  {
+    // Flush every log record to disk before the change returns
+    bool sync = true;
+    // Log size after which the next change triggers a checkpoint
+    uint64_t checkpoint_bytes = 64 * 1024 * 1024;
+  };
+  // Opens the tree stored at path, creating it if there is no such file.
+  // Changes are appended to a redo log at path + ".log" instead of
+  // rewriting the file, the log is replayed on open and folded into the
+  // file by checkpoints.
+  static dstree open_file(
+    const char* path,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+  static dstree open_file(
+    const char* path, const file_options& options,
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+  void checkpoint();
 
   dstree insert(const key& k);
   void erase(const dstree& node);
+  dstree extract_subtree(
+    std::pmr::memory_resource* resource = std::pmr::get_default_resource());
+  dstree graft(const uint8_t* binary, size_t length);
+  void move_subtree(const dstree& node);
   key data() const;
   void for_each_child(const for_each_callback& callback);
   void for_each_matching_child(const key& k,
                                const for_each_callback& callback);
   dstree find(const key& k);
+  // Look up many keys at once with the searches interleaved, so their cache
+  // misses overlap. Keys that aren't found give empty results.
+  std::vector<std::optional<dstree>> find_many(const std::vector<key>& keys);
+  // Each path is a sequence of keys starting at this node
+  std::vector<std::optional<dstree>> find_paths(
+    const std::vector<std::vector<key>>& paths);
+
+  // Children are ordered by key: integers first, then floating point numbers
+  // with NaN last, then strings in strcmp order. Children with equal keys
+  // keep their insertion order.
+  std::optional<dstree> lower_bound(const key& k);
+  std::optional<dstree> upper_bound(const key& k);
+  // Visits children with lo <= key < hi in key order
+  void for_each_child_in_range(const key& lo, const key& hi,
+                               const for_each_callback& callback);
+  void for_each_child_with_prefix(const char* prefix,
+                                  const for_each_callback& callback);
+  // Child at position i in key order, none if there are fewer children
+  std::optional<dstree> nth_child(size_t i);
+  // Number of children with keys less than k, the position of lower_bound
+  size_t rank(const key& k);
+  // Visits up to count children in key order, starting at position offset
+  void for_each_child_page(size_t offset, size_t count,
+                           const for_each_callback& callback);
   size_t size();
+  // Number of nodes in the subtree of this node including itself, kept
+  // up to date by every change
+  size_t subtree_size();
+  tree_stats stats();
 
   void set_data(key k);
 
+  // Removes every child of the root and resets its data, keeping the
+  // capacity of the tree and its enabled indexes. Handles to other nodes
+  // become stale.
+  void clear();
+  // Repacks child ranges and strings and releases spare capacity. Node ids
+  // and handles are kept, reorder also drops unused node slots.
+  void shrink_to_fit();
+
+  void enable_global_index();
+  std::vector<dstree> find_all_global(const key& k);
+
+  void freeze(size_t min_fanout = 64);
+
+  // Stores nodes in preorder, so walks become a linear sweep over the node
+  // table. Handles to nodes other than the root become stale. Trees made by
+  // builder, extract_subtree and deserialization of such trees are already
+  // in preorder until their structure changes.
+  void reorder();
+  // Visits this node and its subtree in preorder, depth is relative to this
+  // node. Returning false skips the subtree of the visited node. The tree
+  // must not be changed from the callback.
+  using walk_callback = std::function<bool(dstree& node, size_t depth)>;
+  void walk(const walk_callback& callback);
+
+  void enable_subtree_hashes();
+  uint64_t subtree_hash();
+
 private:
-  explicit dstree(const key& data, dstree* root, uint64_t node_id);
+  template <class... Levels>
+  friend class typed_view;
 
   struct impl;
+  dstree(impl* p, void (*deleter)(impl*));
+  // Checks the key types below this node for typed_view, types are
+  // dstree_::node_value::type values
+  uint64_t typed_tables(const uint8_t* types, size_t n, dstree_::tables& out);
+  void for_each_child_from(
+    const key& from,
+    const std::function<bool(dstree&, const key&)>& callback);
+  void for_each_child_from(
+    size_t first, const std::function<bool(dstree&, const key&)>& callback);
+
   std::unique_ptr<impl, void (*)(impl*)> pimpl;
 };
\ No newline at end of file
@@ -0,0 +1,163 @@
+#pragma once
+#include <cstdint>
+#include <memory_resource>
+#include <vector>
+
+// Layout of serialized trees. The image starts with the header, followed by
+// the node, child and string tables and the optional extra tables, each
+// prefixed with its element count.
+namespace dstree_ {
+using buffer = std::pmr::vector<uint8_t>;
+
+#pragma pack(push, 1)
+class header
+{
+public:
+  static constexpr size_t struct_size = 32;
+
+  // Version 2 keeps child ranges ordered by key, version 1 by node id.
+  // Readers take images of every version up to the current one as they are,
+  // changes need the current layout, see dstree::upgrade.
+  static constexpr uint32_t ordered_childs_version = 2;
+  static constexpr uint32_t current_version = ordered_childs_version;
+
+  uint32_t version = current_version;
+  uint64_t free_node_id = 0;
+  uint32_t node_array_growth_factor = 1;
+  uint32_t childs_array_growth_factor = 1;
+  uint8_t extra_tables = 0;
+  uint8_t flags = 0;
+  // Last log record folded into the image of a file-backed tree
+  uint64_t checkpoint_lsn = 0;
+  uint8_t reserved[2] = { 0, 0 };
+
+  // Nodes are stored in preorder from id 0 without gaps and have
+  // subtree_size set, only free slots may follow them. Cleared by any change
+  // to the structure of the tree.
+  static constexpr uint8_t preorder_flag = 1;
+  // Every valid node has subtree_size set, kept up to date by all changes.
+  // Images written before the counts existed don't have it.
+  static constexpr uint8_t subtree_sizes_flag = 2;
+  // Extents of released strings are stored in a table of string_extent
+  // right after the extra tables.
+  static constexpr uint8_t free_strings_flag = 4;
+};
+static_assert(sizeof(header) == header::struct_size);
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct node_value
+{
+  static constexpr size_t struct_size = 9;
+
+  node_value() noexcept;
+  node_value(int64_t value, buffer* parent = nullptr) noexcept;
+  node_value(double value, buffer* parent = nullptr) noexcept;
+  node_value(const char* value, buffer* parent) noexcept;
+
+  enum class type : uint8_t
+  {
+    integer,
+    floating_point,
+    string_index
+  };
+
+  // String indexes with this bit set are ids in the dictionary of the tree
+  static constexpr uint64_t dictionary_flag = uint64_t(1) << 63;
+
+  type t = type::integer;
+  union
+  {
+    int64_t integer = 0;
+    double floating_point;
+    uint64_t string_index;
+  } data;
+};
+static_assert(sizeof(node_value) == node_value::struct_size);
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct node
+{
+  static constexpr size_t struct_size = 48;
+
+  uint64_t child_nodes_begin = ~0;
+  uint32_t child_nodes_capacity = 0;
+  uint32_t child_nodes_size = 0;
+  node_value value;
+  uint8_t valid = 0;
+  uint64_t parent_node = ~0;
+  uint32_t generation = 0;
+  // Number of nodes in the subtree including this one, see header flags.
+  // In preorder layout the subtree occupies [id, id + subtree_size).
+  uint64_t subtree_size = 0;
+  uint8_t reserved[2] = { 0, 0 };
+};
+static_assert(sizeof(node) == node::struct_size);
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct child
+{
+  static constexpr size_t struct_size = 12;
+
+  uint64_t node_id = ~0;
+  uint8_t allocated = 0;
+  uint8_t reserved[3] = { 0, 0, 0 };
+
+  bool valid() const { return node_id != child().node_id; }
+
+  friend bool operator<(const child& lhs, const child& rhs)
+  {
+    return lhs.node_id < rhs.node_id;
+  }
+};
+static_assert(sizeof(child) == child::struct_size);
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct frozen_range
+{
+  static constexpr size_t struct_size = 24;
+
+  uint64_t node_id = ~0;
+  uint64_t begin = 0;
+  uint64_t size = 0;
+};
+static_assert(sizeof(frozen_range) == frozen_range::struct_size);
+#pragma pack(pop)
+
+// Bytes of released strings, reused by strings created later
+#pragma pack(push, 1)
+struct string_extent
+{
+  static constexpr size_t struct_size = 16;
+
+  uint64_t begin = 0;
+  uint64_t size = 0;
+};
+static_assert(sizeof(string_extent) == string_extent::struct_size);
+#pragma pack(pop)
+
+#pragma pack(push, 1)
+struct frozen_child
+{
+  static constexpr size_t struct_size = 17;
+
+  node_value value;
+  uint64_t node_id = ~0;
+};
+static_assert(sizeof(frozen_child) == frozen_child::struct_size);
+#pragma pack(pop)
+
+// Table pointers of an image, invalidated by any change to the tree
+struct tables
+{
+  node* nodes = nullptr;
+  child* childs = nullptr;
+  const char* strings = nullptr;
+  // Strings of the dictionary and their offsets, if the tree has one
+  const char* dictionary_strings = nullptr;
+  const uint64_t* dictionary_offsets = nullptr;
+};
+}
@@ -0,0 +1,158 @@
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <dstree/dstree.hpp>
+#include <dstree/format.hpp>
+#include <optional>
+#include <type_traits>
+
+namespace dstree_ {
+template <class T>
+struct level_traits;
+
+template <>
+struct level_traits<int64_t>
+{
+  static constexpr auto type = node_value::type::integer;
+  static int64_t get(const tables&, const node_value& v)
+  {
+    return v.data.integer;
+  }
+  static bool less(int64_t lhs, int64_t rhs) { return lhs < rhs; }
+  static bool equal(int64_t lhs, int64_t rhs) { return lhs == rhs; }
+};
+
+template <>
+struct level_traits<double>
+{
+  static constexpr auto type = node_value::type::floating_point;
+  static double get(const tables&, const node_value& v)
+  {
+    return v.data.floating_point;
+  }
+  // NaNs go after all other numbers, as in untyped lookups
+  static bool less(double lhs, double rhs)
+  {
+    return !std::isnan(lhs) && (std::isnan(rhs) || lhs < rhs);
+  }
+  // NaN never matches, as in untyped lookups
+  static bool equal(double lhs, double rhs) { return lhs == rhs; }
+};
+
+template <>
+struct level_traits<const char*>
+{
+  static constexpr auto type = node_value::type::string_index;
+  static const char* get(const tables& t, const node_value& v)
+  {
+    const auto i = v.data.string_index;
+    if (i & node_value::dictionary_flag)
+      return t.dictionary_strings +
+        t.dictionary_offsets[i & ~node_value::dictionary_flag];
+    return t.strings + i;
+  }
+  static bool less(const char* lhs, const char* rhs)
+  {
+    return strcmp(lhs, rhs) < 0;
+  }
+  static bool equal(const char* lhs, const char* rhs)
+  {
+    return !strcmp(lhs, rhs);
+  }
+};
+}
+
+// Leaf of a typed view, the types of keys below it aren't checked
+template <>
+class typed_view<>
+{
+public:
+  size_t size() const { return t.nodes[node_id].child_nodes_size; }
+
+private:
+  template <class... Levels>
+  friend class typed_view;
+
+  typed_view(const dstree_::tables& t_, uint64_t node_id_)
+    : t(t_)
+    , node_id(node_id_)
+  {
+  }
+
+  dstree_::tables t;
+  uint64_t node_id;
+};
+
+// View of a subtree whose children have keys of type T, grandchildren of
+// the first type of Rest and so on. Key types are checked once on
+// construction, so lookups read and compare keys without dispatching on
+// their type. Like a string_view, the view doesn't keep the tree alive and
+// must not be used after the tree changes.
+template <class T, class... Rest>
+class typed_view<T, Rest...>
+{
+  using traits = dstree_::level_traits<T>;
+
+public:
+  using key_type = T;
+  using child_view = typed_view<Rest...>;
+
+  explicit typed_view(dstree& node)
+  {
+    static constexpr uint8_t types[] = {
+      static_cast<uint8_t>(traits::type),
+      static_cast<uint8_t>(dstree_::level_traits<Rest>::type)...
+    };
+    node_id = node.typed_tables(types, sizeof(types), t);
+  }
+
+  size_t size() const { return t.nodes[node_id].child_nodes_size; }
+
+  T key(size_t i) const
+  {
+    return traits::get(t, t.nodes[begin()[i].node_id].value);
+  }
+
+  child_view child(size_t i) const
+  {
+    return child_view(t, begin()[i].node_id);
+  }
+
+  // Position of the first child with a key not less than k
+  size_t lower_bound(T k) const
+  {
+    auto first = begin();
+    auto it = std::partition_point(
+      first, first + size(), [&](const dstree_::child& ch) {
+        return traits::less(traits::get(t, t.nodes[ch.node_id].value), k);
+      });
+    return it - first;
+  }
+
+  std::optional<child_view> find(T k) const
+  {
+    const auto i = lower_bound(k);
+    if (i == size() || !traits::equal(key(i), k))
+      return std::nullopt;
+    return child(i);
+  }
+
+private:
+  template <class... Levels>
+  friend class typed_view;
+
+  typed_view(const dstree_::tables& t_, uint64_t node_id_)
+    : t(t_)
+    , node_id(node_id_)
+  {
+  }
+
+  const dstree_::child* begin() const
+  {
+    return t.childs + t.nodes[node_id].child_nodes_begin;
+  }
+
+  dstree_::tables t;
+  uint64_t node_id = 0;
+};
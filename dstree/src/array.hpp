@@ -1,3 +1,5 @@
+#include "instrumentation.hpp"
+#include <algorithm>
 #include <cstdint>
 #include <vector>
 
@@ -45,7 +47,8 @@ public:
                                 struct_size);
   }
 
-  static array<T>& get(std::vector<uint8_t>& parent,
+  template <class Buffer>
+  static array<T>& get(Buffer& parent,
                        arrays_start start = arrays_start(0),
                        array_index i = array_index(0),
                        arrays_schema schema = arrays_schema().add<T>())
@@ -68,43 +71,36 @@ public:
     return *reinterpret_cast<array<T>*>(arr_ptr);
   }
 
-  void resize(uint64_t new_size, std::vector<uint8_t>& parent);
+  template <class Buffer>
+  void resize(uint64_t new_size, Buffer& parent);
 };
 static_assert(sizeof(array<int>) == array<int>::struct_size);
 #pragma pack(pop)
 
 template <class T>
-inline void array<T>::resize(uint64_t new_size, std::vector<uint8_t>& parent)
+template <class Buffer>
+inline void array<T>::resize(uint64_t new_size, Buffer& parent)
 {
+  DSTREE_MEASURE(resize);
   auto offset = reinterpret_cast<uint8_t*>(this) - parent.data();
   if (new_size != size) {
-    const int64_t size_delta = new_size - size;
     const uint64_t old_parent_size = parent.size();
-    uint64_t j = offset + struct_size + size * sizeof(T);
+    const uint64_t end = offset + struct_size + size * sizeof(T);
+    const bool grow = new_size > size;
+    const uint64_t delta =
+      (grow ? new_size - size : size - new_size) * sizeof(T);
     size = new_size;
 
-    enum
-    {
-      resize,
-      move
-    };
-
-    int todo[] = { resize, move };
-    if (size_delta < 0)
-      std::swap(todo[0], todo[1]);
-
-    for (int doing : todo) {
-      switch (doing) {
-        case resize:
-          parent.resize(old_parent_size + size_delta * sizeof(T));
-          break;
-        case move:
-          while (j < old_parent_size) {
-            std::swap(parent[j], parent[j + size_delta * sizeof(T)]);
-            ++j;
-          }
-          break;
-      }
+    // Tables stored after this one are shifted to keep the layout contiguous
+    if (grow) {
+      parent.resize(old_parent_size + delta);
+      std::copy_backward(parent.begin() + end,
+                         parent.begin() + old_parent_size, parent.end());
+      std::fill(parent.begin() + end, parent.begin() + end + delta, 0);
+    } else {
+      std::copy(parent.begin() + end, parent.end(),
+                parent.begin() + end - delta);
+      parent.resize(old_parent_size - delta);
     }
   }
 }
@@ -0,0 +1,162 @@
+#include "tree.hpp"
+#include <algorithm>
+#include <atomic>
+#include <dstree/dstree.hpp>
+#include <mutex>
+#include <stdexcept>
+
+// Loaded dictionaries are registered by id, so trees that only store the id
+// can resolve their strings. Lookups from trees go through a per-thread
+// cache that is dropped whenever the registry changes.
+namespace {
+struct registry_entry
+{
+  std::weak_ptr<const dstree::dictionary> dictionary;
+  const dstree_::dictionary_data* data = nullptr;
+};
+
+std::mutex registry_mutex;
+std::unordered_map<uint64_t, registry_entry> registry;
+std::atomic<uint64_t> registry_version{ 0 };
+
+uint64_t content_id(const dstree_::dictionary_data& d)
+{
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (auto c : d.strings)
+    h = (h ^ static_cast<uint8_t>(c)) * 0x100000001b3ULL;
+  // Zero means no dictionary in tree images
+  return h ? h : 1;
+}
+
+void index_strings(dstree_::dictionary_data& d)
+{
+  d.offsets.clear();
+  for (uint64_t pos = 0; pos < d.strings.size();) {
+    d.offsets.push_back(pos);
+    pos += strlen(d.strings.data() + pos) + 1;
+  }
+}
+}
+
+const dstree_::dictionary_data* dstree_::find_dictionary(uint64_t id)
+{
+  struct cache_entry
+  {
+    uint64_t id = 0;
+    uint64_t version = ~0ULL;
+    const dictionary_data* data = nullptr;
+  };
+  thread_local cache_entry cache;
+
+  const auto version = registry_version.load(std::memory_order_acquire);
+  if (cache.id == id && cache.version == version)
+    return cache.data;
+
+  std::lock_guard l(registry_mutex);
+  auto it = registry.find(id);
+  cache.id = id;
+  cache.version = registry_version.load(std::memory_order_relaxed);
+  cache.data = it == registry.end() ? nullptr : it->second.data;
+  return cache.data;
+}
+
+dstree::dictionary::dictionary()
+  : s(std::make_unique<dstree_::dictionary_data>())
+{
+}
+
+dstree::dictionary::~dictionary()
+{
+  std::lock_guard l(registry_mutex);
+  auto it = registry.find(s->id);
+  if (it != registry.end() && it->second.data == s.get())
+    registry.erase(it);
+  registry_version.fetch_add(1, std::memory_order_release);
+}
+
+std::shared_ptr<const dstree::dictionary> dstree::dictionary::create(
+  std::vector<std::string> strings)
+{
+  // Strings end at their first zero byte, as they do in trees
+  for (auto& str : strings)
+    str.resize(strlen(str.c_str()));
+  std::sort(strings.begin(), strings.end(),
+            [](const std::string& lhs, const std::string& rhs) {
+              return strcmp(lhs.c_str(), rhs.c_str()) < 0;
+            });
+  strings.erase(std::unique(strings.begin(), strings.end()), strings.end());
+
+  std::shared_ptr<dictionary> res(new dictionary());
+  for (auto& str : strings)
+    res->s->strings.insert(res->s->strings.end(), str.c_str(),
+                           str.c_str() + str.size() + 1);
+  index_strings(*res->s);
+  res->s->id = content_id(*res->s);
+
+  // Dictionaries with equal contents are shared
+  std::lock_guard l(registry_mutex);
+  auto& entry = registry[res->s->id];
+  if (auto existing = entry.dictionary.lock()) {
+    if (existing->s->strings != res->s->strings)
+      throw std::runtime_error("dictionary id collision");
+    return existing;
+  }
+  entry.dictionary = res;
+  entry.data = res->s.get();
+  registry_version.fetch_add(1, std::memory_order_release);
+  return res;
+}
+
+std::shared_ptr<const dstree::dictionary> dstree::dictionary::deserialize(
+  const uint8_t* binary, size_t length)
+{
+  uint64_t header[2];
+  if (length < sizeof(header))
+    throw std::runtime_error("corrupted dictionary");
+  memcpy(header, binary, sizeof(header));
+  if (header[1] != length - sizeof(header) ||
+      (header[1] && binary[length - 1]))
+    throw std::runtime_error("corrupted dictionary");
+
+  std::vector<std::string> strings;
+  for (auto p = binary + sizeof(header); p < binary + length;) {
+    strings.emplace_back(reinterpret_cast<const char*>(p));
+    p += strings.back().size() + 1;
+  }
+  auto res = create(std::move(strings));
+  if (res->id() != header[0])
+    throw std::runtime_error("corrupted dictionary");
+  return res;
+}
+
+std::shared_ptr<const dstree::dictionary> dstree::dictionary::find(
+  uint64_t id)
+{
+  std::lock_guard l(registry_mutex);
+  auto it = registry.find(id);
+  return it == registry.end() ? nullptr : it->second.dictionary.lock();
+}
+
+size_t dstree::dictionary::serialize(uint8_t* buf, size_t buf_size) const
+{
+  const uint64_t header[2] = { s->id, s->strings.size() };
+  const auto size = sizeof(header) + s->strings.size();
+  if (buf) {
+    std::vector<uint8_t> bytes(size);
+    memcpy(bytes.data(), header, sizeof(header));
+    std::copy(s->strings.begin(), s->strings.end(),
+              bytes.begin() + sizeof(header));
+    memcpy(buf, bytes.data(), std::min(size, buf_size));
+  }
+  return size;
+}
+
+uint64_t dstree::dictionary::id() const
+{
+  return s->id;
+}
+
+size_t dstree::dictionary::size() const
+{
+  return s->offsets.size();
+}
@@ -1,6 +1,9 @@
+#include "instrumentation.hpp"
+#include "journal.hpp"
 #include "tree.hpp"
 #include <algorithm>
 #include <dstree/dstree.hpp>
+#include <new>
 #include <optional>
 #include <stdexcept>
 #include <vector>
@@ -11,23 +14,90 @@ struct root_node
   uint8_t* data = nullptr;
   size_t size = 0;
 };
-struct root_node_owning
+
+// Buffers of dropped scratch trees, kept until the thread exits. Big
+// buffers aren't pooled so one huge tree doesn't pin its memory.
+constexpr size_t scratch_pool_size = 64;
+constexpr size_t max_scratch_bytes = 64 * 1024 * 1024;
+
+thread_local bool scratch_pool_destroyed = false;
+
+struct scratch_pool
 {
-  std::vector<uint8_t> holder;
+  ~scratch_pool() { scratch_pool_destroyed = true; }
+
+  std::vector<dstree_::buffer> buffers;
 };
-struct child_node
+
+std::vector<dstree_::buffer>* get_scratch_pool()
 {
-  dstree* parent = nullptr;
-  uint64_t node_id = ~0;
+  thread_local scratch_pool pool;
+  return scratch_pool_destroyed ? nullptr : &pool.buffers;
+}
+
+// Tree bytes shared by every handle, the holder is used in owning mode
+struct storage
+{
+  explicit storage(std::pmr::memory_resource* resource)
+    : holder(resource)
+  {
+  }
+
+  ~storage()
+  {
+    auto pool = pooled ? get_scratch_pool() : nullptr;
+    if (pool && pool->size() < scratch_pool_size &&
+        holder.capacity() <= max_scratch_bytes) {
+      holder.clear();
+      pool->push_back(std::move(holder));
+    }
+  }
+
+  bool owning() const { return !root; }
+  uint8_t* data() { return root ? root->data : holder.data(); }
+  size_t size() const { return root ? root->size : holder.size(); }
+
+  std::optional<root_node> root;
+  dstree_::buffer holder;
+  // Set for trees opened with open_file
+  std::unique_ptr<dstree_::journal> journal;
+  // Kept loaded for as long as the tree uses it
+  std::shared_ptr<const dstree::dictionary> dictionary;
+  // Holder goes back to the scratch pool
+  bool pooled = false;
 };
 
+void attach_dictionary(storage& s)
+{
+  const auto id = dstree_::dictionary_id(s.data());
+  s.dictionary = id ? dstree::dictionary::find(id) : nullptr;
+  if (id && !s.dictionary)
+    throw std::runtime_error("dictionary of the tree isn't loaded");
+}
+
 dstree_::node_value key_to_internal_format(const dstree::key& key,
-                                           std::vector<uint8_t>& holder)
+                                           dstree_::buffer& holder)
 {
   return std::visit(
     [&](const auto& v) { return dstree_::node_value(v, &holder); }, key);
 }
 
+dstree_::lookup_key key_to_lookup_format(const dstree::key& key)
+{
+  dstree_::lookup_key res;
+  if (auto v = std::get_if<int64_t>(&key)) {
+    res.t = dstree_::node_value::type::integer;
+    res.data.integer = *v;
+  } else if (auto v = std::get_if<double>(&key)) {
+    res.t = dstree_::node_value::type::floating_point;
+    res.data.floating_point = *v;
+  } else {
+    res.t = dstree_::node_value::type::string_index;
+    res.data.string = std::get<const char*>(key);
+  }
+  return res;
+}
+
 dstree::key key_to_interface_format(const dstree_::node_value& value,
                                     uint8_t* holder)
 {
@@ -46,77 +116,190 @@ dstree::key key_to_interface_format(const dstree_::node_value& value,
 
 struct dstree::impl
 {
-  std::optional<root_node> root;
-  std::optional<root_node_owning> root_owning;
-  std::optional<child_node> child;
+  impl(std::pmr::memory_resource* resource_, std::shared_ptr<storage> root_,
+       uint64_t node_id_)
+    : resource(resource_)
+    , root(std::move(root_))
+    , node_id(node_id_)
+    , generation(dstree_::get_node(root->data(), node_id)->generation)
+  {
+  }
+
+  template <class... Args>
+  static impl* create(std::pmr::memory_resource* resource, Args&&... args)
+  {
+    std::pmr::polymorphic_allocator<impl> alloc(resource);
+    return new (alloc.allocate(1)) impl(std::forward<Args>(args)...);
+  }
+
+  static void destroy(impl* p)
+  {
+    std::pmr::polymorphic_allocator<impl> alloc(p->resource);
+    p->~impl();
+    alloc.deallocate(p, 1);
+  }
+
+  static std::shared_ptr<storage> create_storage(
+    std::pmr::memory_resource* resource)
+  {
+    return std::allocate_shared<storage>(
+      std::pmr::polymorphic_allocator<storage>(resource), resource);
+  }
 
-  auto get_root()
+  dstree handle(uint64_t id)
   {
-    auto pimpl_ = this;
-    while (pimpl_->child)
-      pimpl_ = pimpl_->child->parent->pimpl.get();
-    return pimpl_;
+    return dstree(create(resource, resource, root, id), destroy);
   }
 
   uint8_t* get_data()
   {
-    auto pimpl_ = get_root();
-    return pimpl_->root_owning ? pimpl_->root_owning->holder.data()
-                               : pimpl_->root->data;
+    auto data = root->data();
+    auto n = dstree_::get_node(data, node_id);
+    if (!n || !n->valid || n->generation != generation)
+      throw std::runtime_error("stale node handle");
+    return data;
+  }
+
+  dstree_::buffer& get_holder(const char* error)
+  {
+    get_data();
+    if (!root->owning())
+      throw std::runtime_error(error);
+    return root->holder;
+  }
+
+  // Called after a change succeeded, so replay never sees failing records
+  void log(dstree_::log_record t,
+           const dstree_::log_payload& payload = dstree_::log_payload())
+  {
+    if (root->journal)
+      root->journal->append(t, payload, root->holder);
   }
+
+  std::pmr::memory_resource* resource;
+  std::shared_ptr<storage> root;
+  uint64_t node_id;
+  uint32_t generation;
 };
 
 dstree::dstree()
-  : pimpl(new impl, [](impl* p) { delete p; })
+  : dstree(key(), std::pmr::get_default_resource())
 {
-  pimpl->root_owning = root_node_owning();
-  dstree_::init_empty_tree(pimpl->root_owning->holder);
-  dstree_::create_node(pimpl->root_owning->holder);
 }
 
 dstree::dstree(const key& data)
-  : dstree()
+  : dstree(data, std::pmr::get_default_resource())
 {
-  dstree_::set_value(pimpl->root_owning->holder.data(), 0,
-                     key_to_internal_format(data, pimpl->root_owning->holder));
 }
 
-dstree::dstree(const key& data, dstree* parent, uint64_t node_id)
-  : pimpl(new impl, [](impl* p) { delete p; })
+dstree::dstree(const key& data, std::pmr::memory_resource* resource)
+  : pimpl(nullptr, impl::destroy)
 {
-  pimpl->child = { parent, node_id };
+  auto root = impl::create_storage(resource);
+  dstree_::init_empty_tree(root->holder);
+  dstree_::create_node(root->holder);
+  pimpl.reset(impl::create(resource, resource, root, 0));
+  set_data(data);
 }
 
-dstree dstree::deserialize(const uint8_t* binary, size_t length, owning_mode m)
+dstree dstree::scratch(const key& data)
 {
-  dstree res;
+  auto resource = std::pmr::new_delete_resource();
+  auto root = impl::create_storage(resource);
+  root->pooled = true;
+  auto pool = get_scratch_pool();
+  if (pool && !pool->empty()) {
+    root->holder.swap(pool->back());
+    pool->pop_back();
+  }
+  dstree_::init_empty_tree(root->holder);
+  dstree_::create_node(root->holder);
+  dstree res(impl::create(resource, resource, root, 0), impl::destroy);
+  res.set_data(data);
+  return res;
+}
 
-  if (m == owning_mode::owning)
-    res.pimpl->root_owning->holder =
-      std::vector<uint8_t>(binary, binary + length);
-  else {
-    res.pimpl->root_owning.reset();
-    res.pimpl->root = root_node{ const_cast<uint8_t*>(binary), length };
+void dstree::reserve_scratch(size_t count, size_t bytes)
+{
+  auto pool = get_scratch_pool();
+  while (pool && count-- && pool->size() < scratch_pool_size) {
+    pool->emplace_back(std::pmr::new_delete_resource());
+    pool->back().reserve(bytes);
   }
+}
 
-  return res;
+dstree::dstree(const dstree& other)
+  : pimpl(impl::create(other.pimpl->resource, *other.pimpl), impl::destroy)
+{
 }
 
-size_t dstree::serialize(uint8_t* buf, size_t buf_size)
+dstree& dstree::operator=(const dstree& other)
 {
-  uint8_t* data;
-  size_t size;
+  if (this != &other)
+    pimpl.reset(impl::create(other.pimpl->resource, *other.pimpl));
+  return *this;
+}
 
-  if (pimpl->root) {
-    data = pimpl->root->data;
-    size = pimpl->root->size;
-  } else if (pimpl->root_owning) {
-    data = pimpl->root_owning->holder.data();
-    size = pimpl->root_owning->holder.size();
-  } else if (pimpl->child) {
-    throw std::runtime_error("serialization is only for root nodes");
+dstree::dstree(impl* p, void (*deleter)(impl*))
+  : pimpl(p, deleter)
+{
+}
+
+dstree dstree::deserialize(const uint8_t* binary, size_t length, owning_mode m,
+                          std::pmr::memory_resource* resource)
+{
+  dstree_::check_image(binary, length);
+  auto root = impl::create_storage(resource);
+
+  // Owned copies are upgraded, views read older versions as they are
+  if (m == owning_mode::owning) {
+    root->holder.assign(binary, binary + length);
+    dstree_::upgrade(root->holder.data());
   } else
-    return 0;
+    root->root = root_node{ const_cast<uint8_t*>(binary), length };
+  attach_dictionary(*root);
+
+  return dstree(impl::create(resource, resource, root, 0), impl::destroy);
+}
+
+void dstree::upgrade(uint8_t* binary, size_t length)
+{
+  dstree_::check_image(binary, length);
+  dstree_::upgrade(binary);
+}
+
+dstree dstree::open_file(const char* path,
+                         std::pmr::memory_resource* resource)
+{
+  return open_file(path, file_options(), resource);
+}
+
+dstree dstree::open_file(const char* path, const file_options& options,
+                         std::pmr::memory_resource* resource)
+{
+  auto root = impl::create_storage(resource);
+  root->journal = std::make_unique<dstree_::journal>(
+    path, options.sync, options.checkpoint_bytes);
+  root->journal->open(root->holder);
+  attach_dictionary(*root);
+  return dstree(impl::create(resource, resource, root, 0), impl::destroy);
+}
+
+void dstree::checkpoint()
+{
+  pimpl->get_data();
+  if (!pimpl->root->journal)
+    throw std::runtime_error("checkpoint is only for trees opened from files");
+  pimpl->root->journal->checkpoint(pimpl->root->holder);
+}
+
+size_t dstree::serialize(uint8_t* buf, size_t buf_size)
+{
+  if (pimpl->node_id != 0)
+    throw std::runtime_error("serialization is only for root nodes");
+
+  auto data = pimpl->get_data();
+  auto size = pimpl->root->size();
 
   if (buf) {
     auto n = std::min(size, buf_size);
@@ -126,58 +309,143 @@ size_t dstree::serialize(uint8_t* buf, size_t buf_size)
   return size;
 }
 
-dstree dstree::insert(const key& k)
+dstree dstree::replicate(std::pmr::memory_resource* resource)
 {
-  const uint64_t my_node_id = pimpl->child ? pimpl->child->node_id : 0;
+  if (pimpl->node_id != 0)
+    throw std::runtime_error("replicate is only for root nodes");
 
-  auto root = pimpl->get_root();
+  dstree res(key(), resource);
+  auto& holder = res.pimpl->root->holder;
+  holder.resize(serialize(nullptr, 0));
+  serialize(holder.data(), holder.size());
+  // Views may be of older versions, owned copies never are
+  dstree_::upgrade(holder.data());
+  res.pimpl->root->dictionary = pimpl->root->dictionary;
+  return res;
+}
 
-  if (!root->root_owning)
-    throw std::runtime_error("insert is only available in owning mode");
+void dstree::use_dictionary(std::shared_ptr<const dictionary> d)
+{
+  if (pimpl->node_id != 0)
+    throw std::runtime_error("use_dictionary is only for root nodes");
 
-  const auto child_node_id =
-    dstree_::insert(root->root_owning->holder, my_node_id,
-                    key_to_internal_format(k, root->root_owning->holder));
+  dstree_::use_dictionary(
+    pimpl->get_holder("use_dictionary is only available in owning mode"),
+    d ? d->s.get() : nullptr);
+  pimpl->root->dictionary = std::move(d);
+  pimpl->log(dstree_::log_record::use_dictionary,
+             dstree_::log_payload().id(dstree_::dictionary_id(
+               pimpl->root->data())));
+}
 
-  return dstree(k, this, child_node_id);
+dstree dstree::insert(const key& k)
+{
+  DSTREE_MEASURE(insert);
+  auto& holder =
+    pimpl->get_holder("insert is only available in owning mode");
+  const auto value = key_to_internal_format(k, holder);
+  auto res = pimpl->handle(dstree_::insert(holder, pimpl->node_id, value));
+  pimpl->log(dstree_::log_record::insert,
+             dstree_::log_payload().id(pimpl->node_id).key(
+               key_to_lookup_format(k)));
+  return res;
 }
 
 void dstree::erase(const dstree& node)
 {
-  if (!node.pimpl->child || node.pimpl->child->parent != this)
+  DSTREE_MEASURE(erase);
+  auto data = pimpl->get_data();
+  node.pimpl->get_data();
+  if (node.pimpl->root != pimpl->root ||
+      dstree_::get_node(data, node.pimpl->node_id)->parent_node !=
+        pimpl->node_id)
     throw std::runtime_error("erase can only remove child nodes of this node");
 
-  const dstree* root = &node;
-  while (root->pimpl->child)
-    root = root->pimpl->child->parent;
+  auto& holder =
+    pimpl->get_holder("erase is only available for owning root nodes");
+  dstree_::destroy_node(holder, node.pimpl->node_id);
+  pimpl->log(dstree_::log_record::erase,
+             dstree_::log_payload().id(node.pimpl->node_id));
+}
 
-  if (!root->pimpl->root_owning)
-    throw std::runtime_error("erase is only available for owning root nodes");
+dstree dstree::extract_subtree(std::pmr::memory_resource* resource)
+{
+  dstree res(key(), resource);
+  dstree_::extract_subtree(pimpl->get_data(), pimpl->node_id,
+                           res.pimpl->root->holder);
+  res.pimpl->root->dictionary = pimpl->root->dictionary;
+  return res;
+}
+
+dstree dstree::graft(const uint8_t* binary, size_t length)
+{
+  auto& holder = pimpl->get_holder("graft is only available in owning mode");
+  dstree_::check_image(binary, length);
+  const auto src_dictionary =
+    dstree_::dictionary_id(const_cast<uint8_t*>(binary));
+  if (src_dictionary &&
+      src_dictionary != dstree_::dictionary_id(holder.data()))
+    throw std::runtime_error("graft needs both trees to use one dictionary");
 
-  dstree_::destroy_node(root->pimpl->root_owning->holder,
-                        node.pimpl->child->node_id);
+  // Grafting a tree into itself must not read from a reallocated buffer, and
+  // trees of older versions are upgraded first
+  dstree_::buffer copy(pimpl->resource);
+  if ((binary >= holder.data() && binary < holder.data() + holder.size()) ||
+      !dstree_::childs_ordered(const_cast<uint8_t*>(binary))) {
+    copy.assign(binary, binary + length);
+    dstree_::upgrade(copy.data());
+    binary = copy.data();
+  }
+
+  auto res = pimpl->handle(dstree_::graft(holder, pimpl->node_id, binary));
+  pimpl->log(dstree_::log_record::graft,
+             dstree_::log_payload().id(pimpl->node_id).bytes(binary, length));
+  return res;
+}
+
+void dstree::move_subtree(const dstree& node)
+{
+  auto data = pimpl->get_data();
+  node.pimpl->get_data();
+  if (node.pimpl->root != pimpl->root)
+    throw std::runtime_error("move_subtree can only move nodes of this tree");
+  for (auto id = pimpl->node_id; id != dstree_::node().parent_node;
+       id = dstree_::get_node(data, id)->parent_node)
+    if (id == node.pimpl->node_id)
+      throw std::runtime_error(
+        "move_subtree can't move a node into its own subtree");
+
+  dstree_::move_subtree(
+    pimpl->get_holder("move_subtree is only available in owning mode"),
+    node.pimpl->node_id, pimpl->node_id);
+  pimpl->log(
+    dstree_::log_record::move_subtree,
+    dstree_::log_payload().id(node.pimpl->node_id).id(pimpl->node_id));
 }
 
 dstree::key dstree::data() const
 {
-  const uint64_t my_node_id = pimpl->child ? pimpl->child->node_id : 0;
+  auto data = pimpl->get_data();
   return key_to_interface_format(
-    dstree_::get_node(pimpl->get_data(), my_node_id)->value,
-    pimpl->get_data());
+    dstree_::get_node(data, pimpl->node_id)->value, data);
 }
 
 void dstree::for_each_child(const for_each_callback& callback)
 {
-  const uint64_t my_node_id = pimpl->child ? pimpl->child->node_id : 0;
-  auto [begin, end] =
-    dstree_::get_valid_childs_range(pimpl->get_data(), my_node_id);
-  for (auto it = begin; it != end; ++it) {
-    if (auto child_node = dstree_::get_node(pimpl->get_data(), it->node_id)) {
-      dstree child{ key_to_interface_format(child_node->value,
-                                            pimpl->get_data()),
-                    this, it->node_id };
-      callback(child);
-    }
+  // The range is looked up again on every step since the callback is free
+  // to grow the tree
+  std::optional<dstree> child;
+  for (uint32_t i = 0;; ++i) {
+    auto [begin, end] =
+      dstree_::get_valid_childs_range(pimpl->get_data(), pimpl->node_id);
+    if (begin + i >= end)
+      break;
+
+    if (child && child->pimpl)
+      *child->pimpl = impl(pimpl->resource, pimpl->root, begin[i].node_id);
+    else
+      child = pimpl->handle(begin[i].node_id);
+    callback(*child);
   }
 }
 
@@ -201,33 +469,626 @@ void dstree::for_each_matching_child(const key& k,
   });
 }
 
-dstree dstree::find(const key& k)
+namespace {
+using child_range = std::pair<dstree_::child*, dstree_::child*>;
+
+// Children in key order. Version 1 images keep them in id order and can
+// only be read in place, so their children are sorted into scratch once and
+// scratch is reused by later calls.
+child_range ordered_childs(uint8_t* data, uint64_t node_id,
+                           std::vector<dstree_::child>& scratch)
+{
+  auto range = dstree_::get_valid_childs_range(data, node_id);
+  if (dstree_::childs_ordered(data))
+    return range;
+  if (scratch.empty()) {
+    scratch.assign(range.first, range.second);
+    dstree_::sort_childs(data, scratch.data(),
+                         scratch.data() + scratch.size());
+  }
+  return { scratch.data(), scratch.data() + scratch.size() };
+}
+}
+
+uint64_t dstree::typed_tables(const uint8_t* types, size_t n,
+                              dstree_::tables& out)
 {
-  std::optional<dstree> res;
-  for_each_matching_child(k, [&](dstree& child) {
-    if (!res)
-      res = dstree(child.data(), child.pimpl->child->parent,
-                   child.pimpl->child->node_id);
+  auto data = pimpl->get_data();
+  if (!dstree_::childs_ordered(data))
+    throw std::runtime_error(
+      "typed_view needs children ordered by key, upgrade the tree first");
+  if (!dstree_::check_level_types(
+        data, pimpl->node_id,
+        reinterpret_cast<const dstree_::node_value::type*>(types), n))
+    throw std::runtime_error("typed_view levels don't match the tree");
+  out = dstree_::get_tables(data);
+  return pimpl->node_id;
+}
+
+std::optional<dstree> dstree::lower_bound(const key& k)
+{
+  auto data = pimpl->get_data();
+  std::vector<dstree_::child> scratch;
+  auto [begin, end] = ordered_childs(data, pimpl->node_id, scratch);
+  auto it = begin +
+    dstree_::lower_bound(data, pimpl->node_id, key_to_lookup_format(k));
+  if (it == end)
+    return std::nullopt;
+  return pimpl->handle(it->node_id);
+}
+
+std::optional<dstree> dstree::upper_bound(const key& k)
+{
+  auto data = pimpl->get_data();
+  std::vector<dstree_::child> scratch;
+  auto [begin, end] = ordered_childs(data, pimpl->node_id, scratch);
+  auto it = begin +
+    dstree_::upper_bound(data, pimpl->node_id, key_to_lookup_format(k));
+  if (it == end)
+    return std::nullopt;
+  return pimpl->handle(it->node_id);
+}
+
+void dstree::for_each_child_in_range(const key& lo, const key& hi,
+                                     const for_each_callback& callback)
+{
+  const auto hi_key = key_to_lookup_format(hi);
+  for_each_child_from(lo, [&](dstree& child, const key& k) {
+    if (dstree_::compare_keys(key_to_lookup_format(k), hi_key) >= 0)
+      return false;
+    callback(child);
+    return true;
   });
-  if (!res)
+}
+
+void dstree::for_each_child_with_prefix(const char* prefix,
+                                        const for_each_callback& callback)
+{
+  const auto n = strlen(prefix);
+  for_each_child_from(prefix, [&](dstree& child, const key& k) {
+    auto s = std::get_if<const char*>(&k);
+    if (!s || strncmp(*s, prefix, n))
+      return false;
+    callback(child);
+    return true;
+  });
+}
+
+void dstree::for_each_child_from(
+  const key& from, const std::function<bool(dstree&, const key&)>& callback)
+{
+  for_each_child_from(dstree_::lower_bound(pimpl->get_data(), pimpl->node_id,
+                                           key_to_lookup_format(from)),
+                      callback);
+}
+
+void dstree::for_each_child_from(
+  size_t first, const std::function<bool(dstree&, const key&)>& callback)
+{
+  // Like for_each_child the range is looked up on every step, positions stay
+  // valid as long as the callback doesn't touch children before the current
+  std::optional<dstree> child;
+  std::vector<dstree_::child> scratch;
+  for (auto i = first;; ++i) {
+    auto data = pimpl->get_data();
+    auto [begin, end] = ordered_childs(data, pimpl->node_id, scratch);
+    if (i >= static_cast<size_t>(end - begin))
+      break;
+
+    if (child && child->pimpl)
+      *child->pimpl = impl(pimpl->resource, pimpl->root, begin[i].node_id);
+    else
+      child = pimpl->handle(begin[i].node_id);
+    const auto k = key_to_interface_format(
+      dstree_::get_node(data, begin[i].node_id)->value, data);
+    if (!callback(*child, k))
+      break;
+  }
+}
+
+std::optional<dstree> dstree::nth_child(size_t i)
+{
+  auto data = pimpl->get_data();
+  std::vector<dstree_::child> scratch;
+  auto [begin, end] = ordered_childs(data, pimpl->node_id, scratch);
+  if (i >= static_cast<size_t>(end - begin))
+    return std::nullopt;
+  return pimpl->handle(begin[i].node_id);
+}
+
+size_t dstree::rank(const key& k)
+{
+  auto data = pimpl->get_data();
+  return dstree_::lower_bound(data, pimpl->node_id, key_to_lookup_format(k));
+}
+
+void dstree::for_each_child_page(size_t offset, size_t count,
+                                 const for_each_callback& callback)
+{
+  size_t visited = 0;
+  for_each_child_from(offset, [&](dstree& child, const key&) {
+    if (visited++ == count)
+      return false;
+    callback(child);
+    return true;
+  });
+}
+
+dstree dstree::find(const key& k)
+{
+  DSTREE_MEASURE(find);
+  const auto child_node_id = dstree_::find_child(
+    pimpl->get_data(), pimpl->node_id, key_to_lookup_format(k));
+  if (child_node_id == dstree_::node().parent_node)
     throw std::runtime_error("bad lookup");
-  return std::move(*res);
+  return pimpl->handle(child_node_id);
+}
+
+std::vector<std::optional<dstree>> dstree::find_many(
+  const std::vector<key>& keys)
+{
+  std::vector<std::vector<key>> paths(keys.size());
+  for (size_t i = 0; i < keys.size(); ++i)
+    paths[i].push_back(keys[i]);
+  return find_paths(paths);
+}
+
+std::vector<std::optional<dstree>> dstree::find_paths(
+  const std::vector<std::vector<key>>& paths)
+{
+  auto data = pimpl->get_data();
+  std::vector<uint64_t> current(paths.size(), pimpl->node_id);
+
+  // Every level is one interleaved lookup of all paths that are still going
+  std::vector<size_t> active;
+  std::vector<uint64_t> node_ids, found;
+  std::vector<dstree_::lookup_key> keys;
+  for (size_t level = 0;; ++level) {
+    active.clear();
+    node_ids.clear();
+    keys.clear();
+    for (size_t i = 0; i < paths.size(); ++i) {
+      if (level < paths[i].size() &&
+          current[i] != dstree_::node().parent_node) {
+        active.push_back(i);
+        node_ids.push_back(current[i]);
+        keys.push_back(key_to_lookup_format(paths[i][level]));
+      }
+    }
+    if (active.empty())
+      break;
+
+    found.resize(active.size());
+    dstree_::find_children(data, node_ids.data(), keys.data(), active.size(),
+                           found.data());
+    for (size_t j = 0; j < active.size(); ++j)
+      current[active[j]] = found[j];
+  }
+
+  std::vector<std::optional<dstree>> res(paths.size());
+  for (size_t i = 0; i < paths.size(); ++i)
+    if (current[i] != dstree_::node().parent_node)
+      res[i] = pimpl->handle(current[i]);
+  return res;
 }
 
 size_t dstree::size()
 {
-  size_t n = 0;
-  for_each_child([&](auto&) { ++n; });
-  return n;
+  return dstree_::get_node(pimpl->get_data(), pimpl->node_id)
+    ->child_nodes_size;
+}
+
+size_t dstree::subtree_size()
+{
+  return dstree_::subtree_size(pimpl->get_data(), pimpl->node_id);
 }
 
 void dstree::set_data(key k)
 {
-  auto root = pimpl->get_root();
-  if (!root->root_owning)
-    throw std::runtime_error("set_data is only available in owning mode");
+  auto& holder =
+    pimpl->get_holder("set_data is only available in owning mode");
+  const auto value = key_to_internal_format(k, holder);
+  dstree_::set_value(holder, pimpl->node_id, value);
+  pimpl->log(
+    dstree_::log_record::set_value,
+    dstree_::log_payload().id(pimpl->node_id).key(key_to_lookup_format(k)));
+}
+
+void dstree::clear()
+{
+  if (pimpl->node_id != 0)
+    throw std::runtime_error("clear is only for root nodes");
+
+  dstree_::clear(pimpl->get_holder("clear is only available in owning mode"));
+  pimpl->log(dstree_::log_record::clear);
+}
+
+void dstree::shrink_to_fit()
+{
+  dstree_::shrink_to_fit(
+    pimpl->get_holder("shrink_to_fit is only available in owning mode"));
+  pimpl->log(dstree_::log_record::shrink_to_fit);
+}
+
+void dstree::enable_global_index()
+{
+  dstree_::enable_global_index(pimpl->get_holder(
+    "enable_global_index is only available in owning mode"));
+  pimpl->log(dstree_::log_record::enable_global_index);
+}
+
+std::vector<dstree> dstree::find_all_global(const key& k)
+{
+  std::vector<dstree> res;
+  for (auto node_id :
+       dstree_::find_all_global(pimpl->get_data(), key_to_lookup_format(k)))
+    res.push_back(pimpl->handle(node_id));
+  return res;
+}
+
+void dstree::freeze(size_t min_fanout)
+{
+  if (pimpl->node_id != 0)
+    throw std::runtime_error("freeze is only for root nodes");
+
+  const auto fanout =
+    static_cast<uint32_t>(std::min<size_t>(min_fanout, ~0U));
+  dstree_::freeze(
+    pimpl->get_holder("freeze is only available in owning mode"), fanout);
+  pimpl->log(dstree_::log_record::freeze, dstree_::log_payload().id(fanout));
+}
+
+void dstree::reorder()
+{
+  if (pimpl->node_id != 0)
+    throw std::runtime_error("reorder is only for root nodes");
+
+  dstree_::reorder(
+    pimpl->get_holder("reorder is only available in owning mode"));
+  pimpl->log(dstree_::log_record::reorder);
+}
+
+void dstree::walk(const walk_callback& callback)
+{
+  auto data = pimpl->get_data();
+  std::optional<dstree> node;
+  dstree_::walk(data, pimpl->node_id, [&](uint64_t id, size_t depth) {
+    if (node && node->pimpl)
+      *node->pimpl = impl(pimpl->resource, pimpl->root, id);
+    else
+      node = pimpl->handle(id);
+    return callback(*node, depth);
+  });
+}
+
+void dstree::enable_subtree_hashes()
+{
+  dstree_::enable_subtree_hashes(pimpl->get_holder(
+    "enable_subtree_hashes is only available in owning mode"));
+  pimpl->log(dstree_::log_record::enable_subtree_hashes);
+}
+
+uint64_t dstree::subtree_hash()
+{
+  dstree_::hash_cache cache;
+  return dstree_::subtree_hash(pimpl->get_data(), pimpl->node_id,
+                               pimpl->root->owning(), cache);
+}
+
+bool dstree::equal(const dstree& lhs, const dstree& rhs)
+{
+  dstree_::hash_cache lhs_cache, rhs_cache;
+  return dstree_::subtree_hash(lhs.pimpl->get_data(), lhs.pimpl->node_id,
+                               lhs.pimpl->root->owning(), lhs_cache) ==
+    dstree_::subtree_hash(rhs.pimpl->get_data(), rhs.pimpl->node_id,
+                          rhs.pimpl->root->owning(), rhs_cache);
+}
+
+void dstree::diff(const dstree& lhs, const dstree& rhs,
+                  const diff_callback& callback)
+{
+  // Handles are made before any callback runs, so the callback is free to
+  // apply changes to either tree
+  struct change
+  {
+    diff_kind kind;
+    std::optional<dstree> lhs, rhs;
+  };
+  std::vector<change> changes;
+  dstree_::diff(
+    lhs.pimpl->get_data(), lhs.pimpl->node_id, lhs.pimpl->root->owning(),
+    rhs.pimpl->get_data(), rhs.pimpl->node_id, rhs.pimpl->root->owning(),
+    [&](dstree_::diff_kind kind, uint64_t lhs_id, uint64_t rhs_id) {
+      change c{ static_cast<diff_kind>(kind), std::nullopt, std::nullopt };
+      if (lhs_id != dstree_::node().parent_node)
+        c.lhs = lhs.pimpl->handle(lhs_id);
+      if (rhs_id != dstree_::node().parent_node)
+        c.rhs = rhs.pimpl->handle(rhs_id);
+      changes.push_back(std::move(c));
+    });
+
+  for (auto& c : changes)
+    callback(c.kind, c.lhs ? &*c.lhs : nullptr, c.rhs ? &*c.rhs : nullptr);
+}
+
+dstree::tree_stats dstree::stats()
+{
+  auto usage = dstree_::get_usage(pimpl->get_data(), pimpl->root->size());
+  auto to_table_stats = [](const dstree_::table_usage& u) {
+    return table_stats{ u.capacity, u.used, u.bytes };
+  };
+
+  tree_stats res;
+  res.total_bytes = usage.total_bytes;
+  res.nodes = to_table_stats(usage.nodes);
+  res.childs = to_table_stats(usage.childs);
+  res.allocated_childs = usage.allocated_childs;
+  res.wasted_childs = usage.allocated_childs - usage.childs.used;
+  res.strings = to_table_stats(usage.strings);
+  res.dead_string_bytes = usage.strings.capacity - usage.strings.used;
+  res.extra_tables_bytes = usage.extra_tables_bytes;
+  res.node_array_growth_factor = usage.node_array_growth_factor;
+  res.childs_array_growth_factor = usage.childs_array_growth_factor;
+  return res;
+}
+
+void dstree::export_instrumentation(const instrumentation_callback& callback)
+{
+  static_assert(sizeof(operation_stats::latency_histogram) ==
+                sizeof(dstree_::operation_counters::histogram));
+
+  for (size_t i = 0; i < static_cast<size_t>(dstree_::operation::count);
+       ++i) {
+    const auto op = static_cast<dstree_::operation>(i);
+    const auto counters = dstree_::get_counters(op);
+    operation_stats s;
+    s.name = dstree_::operation_name(op);
+    s.count = counters.count;
+    s.total_ns = counters.total_ns;
+    std::copy(std::begin(counters.histogram), std::end(counters.histogram),
+              s.latency_histogram);
+    callback(s);
+  }
+}
+
+void dstree::reset_instrumentation()
+{
+  dstree_::reset_counters();
+}
+struct dstree::builder::state
+{
+  explicit state(std::pmr::memory_resource* resource_)
+    : resource(resource_)
+    , values(resource_)
+    , parents(resource_)
+    , strings(resource_)
+  {
+  }
+
+  void push(const key& k)
+  {
+    dstree_::node_value v;
+    if (auto str = std::get_if<const char*>(&k)) {
+      v.t = dstree_::node_value::type::string_index;
+      v.data.string_index = strings.size();
+      strings.insert(strings.end(), *str, *str + strlen(*str) + 1);
+    } else if (auto d = std::get_if<double>(&k)) {
+      v = dstree_::node_value(*d);
+    } else {
+      v = dstree_::node_value(std::get<int64_t>(k));
+    }
+    values.push_back(v);
+    parents.push_back(path.empty() ? ~0ULL : path.back());
+  }
+
+  std::pmr::memory_resource* resource;
+  std::pmr::vector<dstree_::node_value> values;
+  std::pmr::vector<uint64_t> parents;
+  dstree_::buffer strings;
+  std::vector<uint64_t> path;
+};
+
+dstree::builder::builder(const key& data, std::pmr::memory_resource* resource)
+  : s(std::make_unique<state>(resource))
+{
+  s->push(data);
+  s->path.push_back(0);
+}
+
+dstree::builder::builder(builder&& other) noexcept = default;
+dstree::builder& dstree::builder::operator=(builder&& other) noexcept =
+  default;
+dstree::builder::~builder() = default;
+
+void dstree::builder::open(const key& k)
+{
+  s->push(k);
+  s->path.push_back(s->values.size() - 1);
+}
+
+void dstree::builder::close()
+{
+  if (s->path.size() <= 1)
+    throw std::runtime_error("builder can't close the root node");
+  s->path.pop_back();
+}
+
+void dstree::builder::add(const key& k)
+{
+  s->push(k);
+}
+
+size_t dstree::builder::depth() const
+{
+  return s->path.size() - 1;
+}
+
+dstree dstree::builder::finish()
+{
+  dstree res(key(), s->resource);
+  dstree_::build_tree(res.pimpl->root->holder, s->values.data(),
+                      s->parents.data(), s->values.size(), s->strings.data(),
+                      s->strings.size());
+  // The builder starts over with an empty tree
+  auto resource = s->resource;
+  s = std::make_unique<state>(resource);
+  s->push(key());
+  s->path.push_back(0);
+  return res;
+}
+
+dstree dstree::join(const key& root, const std::vector<dstree>& parts,
+                    size_t threads, std::pmr::memory_resource* resource)
+{
+  std::vector<uint8_t*> data;
+  for (auto& part : parts) {
+    if (part.pimpl->node_id != 0)
+      throw std::runtime_error("join is only for root nodes");
+    data.push_back(part.pimpl->get_data());
+  }
+
+  auto storage = impl::create_storage(resource);
+  dstree_::join_trees(storage->holder, data.data(), data.size(), threads);
+  if (!parts.empty())
+    storage->dictionary = parts[0].pimpl->root->dictionary;
+  dstree res(impl::create(resource, resource, storage, 0), impl::destroy);
+  res.set_data(root);
+  return res;
+}
+
+dstree dstree::build_parallel(const key& root, size_t parts,
+                              const part_callback& build, size_t threads,
+                              std::pmr::memory_resource* resource)
+{
+  std::vector<std::optional<dstree>> built(parts);
+  dstree_::parallel_for(parts, threads,
+                        [&](size_t i) { built[i].emplace(build(i)); });
+
+  std::vector<dstree> trees;
+  trees.reserve(parts);
+  for (auto& t : built)
+    trees.push_back(std::move(*t));
+  return join(root, trees, threads, resource);
+}
+
+struct dstree::batch::state
+{
+  explicit state(const dstree& tree_)
+    : tree(tree_)
+  {
+  }
+
+  void record(dstree_::batch_op::type t, const dstree& node, const key* k)
+  {
+    node.pimpl->get_data();
+    if (node.pimpl->root != tree.pimpl->root)
+      throw std::runtime_error("batch can only change nodes of its tree");
+
+    dstree_::batch_op op;
+    op.t = t;
+    op.node_id = node.pimpl->node_id;
+    op.generation = node.pimpl->generation;
+    if (k)
+      op.value = value(*k);
+    ops.push_back(op);
+  }
+
+  dstree_::node_value value(const key& k)
+  {
+    dstree_::node_value res;
+    if (auto str = std::get_if<const char*>(&k)) {
+      res.t = dstree_::node_value::type::string_index;
+      dictionary = tree.pimpl->root->dictionary;
+      const auto i = dictionary ? dictionary->s->find(*str) : ~0ULL;
+      if (i != ~0ULL) {
+        res.data.string_index = i | dstree_::node_value::dictionary_flag;
+      } else {
+        res.data.string_index = strings.size();
+        strings.insert(strings.end(), *str, *str + strlen(*str) + 1);
+      }
+    } else if (auto d = std::get_if<double>(&k)) {
+      res = dstree_::node_value(*d);
+    } else {
+      res = dstree_::node_value(std::get<int64_t>(k));
+    }
+    return res;
+  }
+
+  dstree tree;
+  std::vector<dstree_::batch_op> ops;
+  std::vector<char> strings;
+  // Dictionary the recorded strings were looked up in
+  std::shared_ptr<const dstree::dictionary> dictionary;
+  size_t inserts = 0;
+};
+
+dstree::batch::batch(const dstree& tree)
+  : s(std::make_unique<state>(tree))
+{
+}
+
+dstree::batch::batch(batch&& other) noexcept = default;
+dstree::batch& dstree::batch::operator=(batch&& other) noexcept = default;
+dstree::batch::~batch() = default;
+
+size_t dstree::batch::insert(const dstree& parent, const key& k)
+{
+  s->record(dstree_::batch_op::type::insert, parent, &k);
+  return s->inserts++;
+}
+
+size_t dstree::batch::insert(size_t parent, const key& k)
+{
+  if (parent >= s->inserts)
+    throw std::runtime_error("batch has no such insert");
 
-  const uint64_t my_node_id = pimpl->child ? pimpl->child->node_id : 0;
-  dstree_::set_value(pimpl->get_data(), my_node_id,
-                     key_to_internal_format(k, root->root_owning->holder));
-}
\ No newline at end of file
+  dstree_::batch_op op;
+  op.t = dstree_::batch_op::type::insert;
+  op.node_id = parent;
+  op.pending = true;
+  op.value = s->value(k);
+  s->ops.push_back(op);
+  return s->inserts++;
+}
+
+void dstree::batch::erase(const dstree& node)
+{
+  s->record(dstree_::batch_op::type::erase, node, nullptr);
+}
+
+void dstree::batch::set_data(const dstree& node, const key& k)
+{
+  s->record(dstree_::batch_op::type::set_value, node, &k);
+}
+
+size_t dstree::batch::size() const
+{
+  return s->ops.size();
+}
+
+std::vector<dstree> dstree::batch::commit()
+{
+  auto& holder =
+    s->tree.pimpl->get_holder("batch is only available in owning mode");
+  if (s->dictionary && s->dictionary != s->tree.pimpl->root->dictionary)
+    throw std::runtime_error(
+      "dictionary of the tree changed after the batch was recorded");
+  const auto ids = dstree_::apply_batch(holder, s->ops, s->strings);
+  s->tree.pimpl->log(dstree_::log_record::batch,
+                     dstree_::log_payload().batch(s->ops, s->strings));
+  rollback();
+
+  std::vector<dstree> res;
+  res.reserve(ids.size());
+  for (auto id : ids)
+    res.push_back(s->tree.pimpl->handle(id));
+  return res;
+}
+
+void dstree::batch::rollback()
+{
+  s->ops.clear();
+  s->strings.clear();
+  s->dictionary = nullptr;
+  s->inserts = 0;
+}
@@ -0,0 +1,72 @@
+#include "instrumentation.hpp"
+#include <atomic>
+
+namespace {
+struct atomic_counters
+{
+  std::atomic<uint64_t> count{ 0 };
+  std::atomic<uint64_t> total_ns{ 0 };
+  std::atomic<uint64_t> histogram[dstree_::histogram_buckets] = {};
+};
+
+atomic_counters counters[static_cast<size_t>(dstree_::operation::count)];
+
+// Bucket i holds latencies in [2^i, 2^(i+1)) nanoseconds
+size_t bucket(uint64_t ns)
+{
+  size_t i = 0;
+  while (ns > 1 && i + 1 < dstree_::histogram_buckets) {
+    ns >>= 1;
+    ++i;
+  }
+  return i;
+}
+}
+
+const char* dstree_::operation_name(operation op)
+{
+  switch (op) {
+    case operation::insert:
+      return "insert";
+    case operation::find:
+      return "find";
+    case operation::erase:
+      return "erase";
+    case operation::resize:
+      return "resize";
+    case operation::allocate_child_range:
+      return "allocate_child_range";
+    case operation::count:
+      break;
+  }
+  return "unknown";
+}
+
+void dstree_::record(operation op, uint64_t ns)
+{
+  auto& c = counters[static_cast<size_t>(op)];
+  c.count.fetch_add(1, std::memory_order_relaxed);
+  c.total_ns.fetch_add(ns, std::memory_order_relaxed);
+  c.histogram[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+}
+
+dstree_::operation_counters dstree_::get_counters(operation op)
+{
+  auto& c = counters[static_cast<size_t>(op)];
+  operation_counters res;
+  res.count = c.count.load(std::memory_order_relaxed);
+  res.total_ns = c.total_ns.load(std::memory_order_relaxed);
+  for (size_t i = 0; i < histogram_buckets; ++i)
+    res.histogram[i] = c.histogram[i].load(std::memory_order_relaxed);
+  return res;
+}
+
+void dstree_::reset_counters()
+{
+  for (auto& c : counters) {
+    c.count = 0;
+    c.total_ns = 0;
+    for (auto& h : c.histogram)
+      h = 0;
+  }
+}
\ No newline at end of file
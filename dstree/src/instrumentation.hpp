@@ -0,0 +1,58 @@
+#pragma once
+#include <chrono>
+#include <cstdint>
+
+namespace dstree_ {
+enum class operation
+{
+  insert,
+  find,
+  erase,
+  resize,
+  allocate_child_range,
+  count
+};
+
+constexpr size_t histogram_buckets = 32;
+
+struct operation_counters
+{
+  uint64_t count = 0;
+  uint64_t total_ns = 0;
+  uint64_t histogram[histogram_buckets] = {};
+};
+
+const char* operation_name(operation op);
+void record(operation op, uint64_t ns);
+operation_counters get_counters(operation op);
+void reset_counters();
+
+class scoped_measure
+{
+public:
+  explicit scoped_measure(operation op_)
+    : op(op_)
+    , start(std::chrono::steady_clock::now())
+  {
+  }
+
+  ~scoped_measure()
+  {
+    record(op,
+           std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+             .count());
+  }
+
+private:
+  const operation op;
+  const std::chrono::steady_clock::time_point start;
+};
+}
+
+#ifdef DSTREE_INSTRUMENTATION
+#  define DSTREE_MEASURE(op)                                                  \
+    dstree_::scoped_measure dstree_measure_(dstree_::operation::op)
+#else
+#  define DSTREE_MEASURE(op)
+#endif
\ No newline at end of file
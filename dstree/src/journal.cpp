@@ -0,0 +1,398 @@
+#include "journal.hpp"
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+#ifdef _WIN32
+#  include <io.h>
+#else
+#  include <fcntl.h>
+#  include <unistd.h>
+#endif
+
+// Log records are laid out as
+//   uint32_t payload size, uint64_t lsn, uint8_t type, payload, uint32_t crc
+// with the crc covering lsn, type and payload. A record cut short or with a
+// wrong crc marks the end of the log, everything after it is dropped.
+namespace {
+constexpr size_t record_overhead = 4 + 8 + 1 + 4;
+
+uint32_t crc32(const uint8_t* p, size_t n, uint32_t crc = 0)
+{
+  static const auto table = [] {
+    std::vector<uint32_t> res(256);
+    for (uint32_t i = 0; i < 256; ++i) {
+      auto c = i;
+      for (int k = 0; k < 8; ++k)
+        c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+      res[i] = c;
+    }
+    return res;
+  }();
+
+  crc = ~crc;
+  for (size_t i = 0; i < n; ++i)
+    crc = table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+  return ~crc;
+}
+
+void sync_file(std::FILE* f, const std::string& name)
+{
+  if (fflush(f))
+    throw std::runtime_error("unable to write " + name);
+#ifdef _WIN32
+  const int res = _commit(_fileno(f));
+#else
+  const int res = fsync(fileno(f));
+#endif
+  if (res)
+    throw std::runtime_error("unable to sync " + name);
+}
+
+// Makes a rename durable, no-op where directories can't be synced
+void sync_directory(const std::filesystem::path& p)
+{
+#ifndef _WIN32
+  auto dir = p.parent_path();
+  const auto name = dir.empty() ? std::string(".") : dir.string();
+  int fd = ::open(name.c_str(), O_RDONLY);
+  if (fd < 0)
+    throw std::runtime_error("unable to open " + name);
+  const bool synced = !fsync(fd) || errno == EINVAL;
+  ::close(fd);
+  if (!synced)
+    throw std::runtime_error("unable to sync " + name);
+#endif
+}
+
+std::vector<uint8_t> read_file(const std::string& path)
+{
+  std::vector<uint8_t> res;
+  if (auto f = std::fopen(path.c_str(), "rb")) {
+    uint8_t buf[64 * 1024];
+    while (auto n = std::fread(buf, 1, sizeof(buf), f))
+      res.insert(res.end(), buf, buf + n);
+    std::fclose(f);
+  }
+  return res;
+}
+
+class payload_reader
+{
+public:
+  payload_reader(const uint8_t* p_, size_t n)
+    : p(p_)
+    , end(p_ + n)
+  {
+  }
+
+  uint64_t id()
+  {
+    uint64_t v;
+    read(&v, sizeof(v));
+    return v;
+  }
+
+  const uint8_t* bytes(uint64_t& n)
+  {
+    n = id();
+    auto res = p;
+    skip(n);
+    return res;
+  }
+
+  // String values point into the payload
+  dstree_::node_value value(dstree_::buffer& tree)
+  {
+    uint8_t t;
+    read(&t, 1);
+    if (t == static_cast<uint8_t>(dstree_::node_value::type::string_index)) {
+      uint64_t n;
+      auto str = reinterpret_cast<const char*>(bytes(n));
+      return dstree_::node_value(std::string(str, n).c_str(), &tree);
+    }
+    dstree_::node_value res;
+    res.t = static_cast<dstree_::node_value::type>(t);
+    read(&res.data, sizeof(res.data));
+    return res;
+  }
+
+  void read(void* dst, size_t n)
+  {
+    auto src = p;
+    skip(n);
+    memcpy(dst, src, n);
+  }
+
+private:
+  void skip(uint64_t n)
+  {
+    if (n > static_cast<uint64_t>(end - p))
+      throw std::runtime_error("corrupted log record");
+    p += n;
+  }
+
+  const uint8_t* p;
+  const uint8_t* end;
+};
+
+void apply(dstree_::log_record t, payload_reader& r, dstree_::buffer& tree)
+{
+  using dstree_::log_record;
+  switch (t) {
+    case log_record::insert: {
+      const auto node_id = r.id();
+      dstree_::insert(tree, node_id, r.value(tree));
+      break;
+    }
+    case log_record::erase:
+      dstree_::destroy_node(tree, r.id());
+      break;
+    case log_record::set_value: {
+      const auto node_id = r.id();
+      const auto value = r.value(tree);
+      dstree_::set_value(tree, node_id, value);
+      break;
+    }
+    case log_record::graft: {
+      const auto node_id = r.id();
+      uint64_t n;
+      auto src = r.bytes(n);
+      const std::vector<uint8_t> copy(src, src + n);
+      dstree_::graft(tree, node_id, copy.data());
+      break;
+    }
+    case log_record::move_subtree: {
+      const auto node_id = r.id();
+      dstree_::move_subtree(tree, node_id, r.id());
+      break;
+    }
+    case log_record::enable_global_index:
+      dstree_::enable_global_index(tree);
+      break;
+    case log_record::freeze:
+      dstree_::freeze(tree, static_cast<uint32_t>(r.id()));
+      break;
+    case log_record::enable_subtree_hashes:
+      dstree_::enable_subtree_hashes(tree);
+      break;
+    case log_record::reorder:
+      dstree_::reorder(tree);
+      break;
+    case log_record::batch: {
+      std::vector<dstree_::batch_op> ops(r.id());
+      for (auto& op : ops) {
+        uint8_t t, pending;
+        r.read(&t, 1);
+        op.t = static_cast<dstree_::batch_op::type>(t);
+        op.node_id = r.id();
+        r.read(&op.generation, sizeof(op.generation));
+        r.read(&pending, 1);
+        op.pending = pending;
+        r.read(&op.value, sizeof(op.value));
+      }
+      uint64_t n;
+      auto strings = reinterpret_cast<const char*>(r.bytes(n));
+      dstree_::apply_batch(tree, ops, std::vector<char>(strings, strings + n));
+      break;
+    }
+    case log_record::use_dictionary: {
+      const auto id = r.id();
+      auto d = id ? dstree_::find_dictionary(id) : nullptr;
+      if (id && !d)
+        throw std::runtime_error("dictionary of the tree isn't loaded");
+      dstree_::use_dictionary(tree, d);
+      break;
+    }
+    case log_record::clear:
+      dstree_::clear(tree);
+      break;
+    case log_record::shrink_to_fit:
+      dstree_::shrink_to_fit(tree);
+      break;
+    default:
+      throw std::runtime_error("unknown log record");
+  }
+}
+}
+
+dstree_::log_payload& dstree_::log_payload::id(uint64_t v)
+{
+  auto p = reinterpret_cast<const uint8_t*>(&v);
+  data.insert(data.end(), p, p + sizeof(v));
+  return *this;
+}
+
+dstree_::log_payload& dstree_::log_payload::key(const lookup_key& k)
+{
+  data.push_back(static_cast<uint8_t>(k.t));
+  if (k.t == node_value::type::string_index)
+    return bytes(k.data.string, strlen(k.data.string));
+  auto p = reinterpret_cast<const uint8_t*>(&k.data);
+  data.insert(data.end(), p, p + 8);
+  return *this;
+}
+
+dstree_::log_payload& dstree_::log_payload::bytes(const void* p, uint64_t n)
+{
+  id(n);
+  auto b = static_cast<const uint8_t*>(p);
+  data.insert(data.end(), b, b + n);
+  return *this;
+}
+
+dstree_::log_payload& dstree_::log_payload::batch(
+  const std::vector<batch_op>& ops, const std::vector<char>& strings)
+{
+  id(ops.size());
+  for (auto& op : ops) {
+    data.push_back(static_cast<uint8_t>(op.t));
+    id(op.node_id);
+    auto g = reinterpret_cast<const uint8_t*>(&op.generation);
+    data.insert(data.end(), g, g + sizeof(op.generation));
+    data.push_back(op.pending);
+    auto v = reinterpret_cast<const uint8_t*>(&op.value);
+    data.insert(data.end(), v, v + sizeof(op.value));
+  }
+  return bytes(strings.data(), strings.size());
+}
+
+dstree_::journal::journal(const std::string& path, bool sync_,
+                          uint64_t checkpoint_bytes_)
+  : image_path(path)
+  , log_path(path + ".log")
+  , sync(sync_)
+  , checkpoint_bytes(checkpoint_bytes_)
+{
+}
+
+dstree_::journal::~journal()
+{
+  close_log();
+}
+
+void dstree_::journal::open(buffer& tree)
+{
+  const auto image = read_file(image_path);
+  if (image.empty()) {
+    init_empty_tree(tree);
+    create_node(tree);
+  } else {
+    check_image(image.data(), image.size());
+    tree.assign(image.begin(), image.end());
+    upgrade(tree.data());
+  }
+  last_lsn = reinterpret_cast<header*>(tree.data())->checkpoint_lsn;
+
+  const auto log_data = read_file(log_path);
+  size_t pos = 0;
+  while (pos + record_overhead <= log_data.size()) {
+    uint32_t size;
+    memcpy(&size, &log_data[pos], sizeof(size));
+    if (size > log_data.size() - pos - record_overhead)
+      break;
+    auto body = &log_data[pos + 4];
+    uint32_t crc;
+    memcpy(&crc, body + 9 + size, sizeof(crc));
+    if (crc != crc32(body, 9 + size))
+      break;
+
+    uint64_t lsn;
+    memcpy(&lsn, body, sizeof(lsn));
+    if (lsn > last_lsn) {
+      payload_reader r(body + 9, size);
+      apply(static_cast<log_record>(body[8]), r, tree);
+      last_lsn = lsn;
+    }
+    pos += record_overhead + size;
+  }
+
+  // A torn tail would hide records appended after it
+  if (pos != log_data.size())
+    std::filesystem::resize_file(log_path, pos);
+  log_size = pos;
+  open_log();
+  if (image.empty())
+    checkpoint(tree);
+}
+
+void dstree_::journal::append(log_record t, const log_payload& payload,
+                              buffer& tree)
+{
+  const auto size = static_cast<uint32_t>(payload.data.size());
+  const auto lsn = last_lsn + 1;
+  std::vector<uint8_t> record(record_overhead + size);
+  memcpy(&record[0], &size, sizeof(size));
+  memcpy(&record[4], &lsn, sizeof(lsn));
+  record[12] = static_cast<uint8_t>(t);
+  std::copy(payload.data.begin(), payload.data.end(), &record[13]);
+  const auto crc = crc32(&record[4], 9 + size);
+  memcpy(&record[13 + size], &crc, sizeof(crc));
+
+  try {
+    if (std::fwrite(record.data(), 1, record.size(), log) != record.size())
+      throw std::runtime_error("unable to write the log");
+    if (sync)
+      sync_file(log, "the log");
+    else if (fflush(log))
+      throw std::runtime_error("unable to write the log");
+  } catch (...) {
+    // The change is already applied in memory. Part of the record may have
+    // reached the file, where it would hide later records from replay, so
+    // the log is cut back and the tree is reloaded without the change.
+    close_log();
+    std::filesystem::resize_file(log_path, log_size);
+    open(tree);
+    throw;
+  }
+  last_lsn = lsn;
+  log_size += record.size();
+
+  if (log_size >= checkpoint_bytes)
+    checkpoint(tree);
+}
+
+void dstree_::journal::checkpoint(buffer& tree)
+{
+  reinterpret_cast<header*>(tree.data())->checkpoint_lsn = last_lsn;
+
+  const auto tmp_path = image_path + ".tmp";
+  auto f = std::fopen(tmp_path.c_str(), "wb");
+  if (!f)
+    throw std::runtime_error("unable to write " + tmp_path);
+  try {
+    if (std::fwrite(tree.data(), 1, tree.size(), f) != tree.size())
+      throw std::runtime_error("unable to write " + tmp_path);
+    sync_file(f, tmp_path);
+  } catch (...) {
+    std::fclose(f);
+    throw;
+  }
+  std::fclose(f);
+
+  std::filesystem::rename(tmp_path, image_path);
+  sync_directory(image_path);
+
+  // Records up to last_lsn are durably in the image now, so a crash before
+  // the log is emptied only leaves records that replay skips
+  close_log();
+  std::filesystem::resize_file(log_path, 0);
+  log_size = 0;
+  open_log();
+}
+
+void dstree_::journal::open_log()
+{
+  log = std::fopen(log_path.c_str(), "ab");
+  if (!log)
+    throw std::runtime_error("unable to open " + log_path);
+}
+
+void dstree_::journal::close_log()
+{
+  if (log) {
+    std::fclose(log);
+    log = nullptr;
+  }
+}
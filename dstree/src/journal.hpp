@@ -0,0 +1,66 @@
+#pragma once
+#include "tree.hpp"
+#include <cstdio>
+#include <string>
+
+namespace dstree_ {
+enum class log_record : uint8_t
+{
+  insert,
+  erase,
+  set_value,
+  graft,
+  move_subtree,
+  enable_global_index,
+  freeze,
+  enable_subtree_hashes,
+  reorder,
+  batch,
+  use_dictionary,
+  clear,
+  shrink_to_fit
+};
+
+class log_payload
+{
+public:
+  log_payload& id(uint64_t v);
+  log_payload& key(const lookup_key& k);
+  log_payload& bytes(const void* p, uint64_t n);
+  log_payload& batch(const std::vector<batch_op>& ops,
+                     const std::vector<char>& strings);
+
+  std::vector<uint8_t> data;
+};
+
+// Redo log of a file-backed tree. The image file holds the tree as of the
+// last checkpoint, whose lsn is stored in the tree header, and the log next
+// to it holds every change made since then.
+class journal
+{
+public:
+  journal(const std::string& path, bool sync, uint64_t checkpoint_bytes);
+  ~journal();
+  journal(const journal&) = delete;
+  journal& operator=(const journal&) = delete;
+
+  // Loads the image, creating it if needed, and replays the log on top
+  void open(buffer& tree);
+  // Logs a change already applied to the tree. If the record can't be
+  // written, the tree is reloaded from the files without the change.
+  void append(log_record t, const log_payload& payload, buffer& tree);
+  // Writes the image next to the old one, swaps them and empties the log
+  void checkpoint(buffer& tree);
+
+private:
+  void open_log();
+  void close_log();
+
+  const std::string image_path, log_path;
+  const bool sync;
+  const uint64_t checkpoint_bytes;
+  std::FILE* log = nullptr;
+  uint64_t log_size = 0;
+  uint64_t last_lsn = 0;
+};
+}
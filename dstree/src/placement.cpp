@@ -0,0 +1,139 @@
+#include <dstree/dstree.hpp>
+#include <new>
+
+#ifdef __linux__
+#  include <sys/mman.h>
+#  include <sys/syscall.h>
+#  include <unistd.h>
+#endif
+
+namespace {
+constexpr size_t huge_page_size = 2 * 1024 * 1024;
+
+size_t round_up(size_t value, size_t alignment)
+{
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+// Buffers at least min_mapping_size bytes long get their own mappings, the
+// rest (handles, small trees) is served by the upstream resource
+class placement_resource : public std::pmr::memory_resource
+{
+public:
+  placement_resource(const dstree::placement_options& options_,
+                     std::pmr::memory_resource* upstream_)
+    : options(options_)
+    , upstream(upstream_)
+  {
+  }
+
+private:
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+#ifdef __linux__
+    if (bytes >= options.min_mapping_size && alignment <= huge_page_size)
+      return map(bytes);
+#endif
+    return upstream->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override
+  {
+#ifdef __linux__
+    if (bytes >= options.min_mapping_size && alignment <= huge_page_size) {
+      munmap(p, mapping_size(bytes));
+      return;
+    }
+#endif
+    upstream->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource& other) const noexcept override
+  {
+    return this == &other;
+  }
+
+#ifdef __linux__
+  size_t mapping_size(size_t bytes) const
+  {
+    return options.huge_pages == dstree::huge_page_mode::none
+      ? round_up(bytes, static_cast<size_t>(sysconf(_SC_PAGESIZE)))
+      : round_up(bytes, huge_page_size);
+  }
+
+  void* map(size_t bytes)
+  {
+    const auto len = mapping_size(bytes);
+    void* p = MAP_FAILED;
+
+    if (options.huge_pages == dstree::huge_page_mode::hugetlb)
+      p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (p == MAP_FAILED && options.huge_pages != dstree::huge_page_mode::none)
+      p = map_huge_page_aligned(len);
+
+    if (p == MAP_FAILED)
+      p = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (p == MAP_FAILED)
+      throw std::bad_alloc();
+
+    bind(p, len);
+    return p;
+  }
+
+  // Transparent huge pages are only used for 2 MB aligned regions, so the
+  // mapping is over-allocated and trimmed
+  void* map_huge_page_aligned(size_t len)
+  {
+    auto raw = mmap(nullptr, len + huge_page_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+      return raw;
+
+    auto begin = reinterpret_cast<uintptr_t>(raw);
+    auto aligned = round_up(begin, huge_page_size);
+    if (aligned > begin)
+      munmap(raw, aligned - begin);
+    if (auto tail = begin + huge_page_size - aligned)
+      munmap(reinterpret_cast<void*>(aligned + len), tail);
+
+    auto p = reinterpret_cast<void*>(aligned);
+#  ifdef MADV_HUGEPAGE
+    madvise(p, len, MADV_HUGEPAGE);
+#  endif
+    return p;
+  }
+
+  // Placement is a hint, kernels without NUMA support keep the default policy
+  void bind(void* p, size_t len)
+  {
+#  ifdef SYS_mbind
+    enum
+    {
+      mpol_bind = 2,
+      mpol_interleave = 3
+    };
+
+    if (options.numa == dstree::numa_policy::none || !options.numa_nodes)
+      return;
+    const unsigned long mask = options.numa_nodes;
+    const int mode =
+      options.numa == dstree::numa_policy::bind ? mpol_bind : mpol_interleave;
+    syscall(SYS_mbind, p, len, mode, &mask, sizeof(mask) * 8 + 1, 0);
+#  endif
+  }
+#endif
+
+  const dstree::placement_options options;
+  std::pmr::memory_resource* const upstream;
+};
+}
+
+std::unique_ptr<std::pmr::memory_resource> dstree::make_placement_resource(
+  const placement_options& options, std::pmr::memory_resource* upstream)
+{
+  return std::make_unique<placement_resource>(options, upstream);
+}
\ No newline at end of file
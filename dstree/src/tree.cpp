@@ -1,14 +1,32 @@
 #include "tree.hpp"
 #include "array.hpp"
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_set>
+
+#ifdef _MSC_VER
+#  include <xmmintrin.h>
+#endif
 
 namespace {
 const dstree_::array_index node_table_id(0), child_table_id(1),
-  string_table_id(2);
+  string_table_id(2), global_index_table_id(3), frozen_ranges_table_id(4),
+  frozen_childs_table_id(5), subtree_hashes_table_id(6),
+  dictionary_table_id(7);
 const auto schema = dstree_::arrays_schema()
                       .add<dstree_::node>()
                       .add<dstree_::child>()
-                      .add<int8_t>();
+                      .add<int8_t>()
+                      .add<uint64_t>()
+                      .add<dstree_::frozen_range>()
+                      .add<dstree_::frozen_child>()
+                      .add<uint64_t>()
+                      .add<uint64_t>();
 }
 
 namespace {
@@ -30,19 +48,169 @@ auto& get_string_array(uint8_t* parent)
     parent, dstree_::arrays_start(dstree_::header::struct_size),
     string_table_id, schema);
 }
+auto& get_global_index_array(uint8_t* parent)
+{
+  return dstree_::array<uint64_t>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    global_index_table_id, schema);
+}
+auto& get_frozen_ranges_array(uint8_t* parent)
+{
+  return dstree_::array<dstree_::frozen_range>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    frozen_ranges_table_id, schema);
+}
+auto& get_frozen_childs_array(uint8_t* parent)
+{
+  return dstree_::array<dstree_::frozen_child>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    frozen_childs_table_id, schema);
+}
+auto& get_subtree_hashes_array(uint8_t* parent)
+{
+  return dstree_::array<uint64_t>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    subtree_hashes_table_id, schema);
+}
+auto& get_dictionary_array(uint8_t* parent)
+{
+  return dstree_::array<uint64_t>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    dictionary_table_id, schema);
+}
 auto& get_header(uint8_t* parent)
 {
   return *reinterpret_cast<dstree_::header*>(parent);
 }
+// Comes after the extra tables, so it moves whenever one is added
+auto& get_free_strings_array(uint8_t* parent)
+{
+  return dstree_::array<dstree_::string_extent>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    dstree_::array_index(string_table_id.value + 1 +
+                         get_header(parent).extra_tables),
+    schema);
+}
+
+bool free_strings_kept(uint8_t* parent)
+{
+  return get_header(parent).flags & dstree_::header::free_strings_flag;
+}
+
+uint64_t extra_tables_end(uint8_t* parent)
+{
+  const auto last_id = string_table_id.value + get_header(parent).extra_tables;
+  auto& last = dstree_::array<uint8_t>::get(
+    parent, dstree_::arrays_start(dstree_::header::struct_size),
+    dstree_::array_index(last_id), schema);
+  return reinterpret_cast<uint8_t*>(&last) - parent +
+    dstree_::array<uint8_t>::struct_size +
+    last.size * schema.array_element_sizes[last_id];
+}
+
+void ensure_extra_tables(dstree_::buffer& parent, uint8_t count)
+{
+  auto& header = get_header(parent.data());
+  if (header.extra_tables >= count)
+    return;
+
+  std::vector<dstree_::string_extent> free_strings;
+  if (free_strings_kept(parent.data())) {
+    auto& arr = get_free_strings_array(parent.data());
+    free_strings.assign(arr.data(), arr.data() + arr.size);
+  }
+
+  // Drop whatever follows the last table, new tables go right after it
+  const auto tables_end = extra_tables_end(parent.data());
+  const auto n = count - header.extra_tables;
+  parent.resize(tables_end);
+  parent.resize(tables_end + n * dstree_::array<uint8_t>::struct_size, 0);
+  get_header(parent.data()).extra_tables = count;
+
+  if (free_strings_kept(parent.data())) {
+    const auto end = parent.size();
+    parent.resize(end + dstree_::array<uint8_t>::struct_size +
+                  free_strings.size() * dstree_::string_extent::struct_size);
+    auto& arr = get_free_strings_array(parent.data());
+    arr.size = free_strings.size();
+    std::copy(free_strings.begin(), free_strings.end(), arr.data());
+  }
+}
+
+const dstree_::dictionary_data* tree_dictionary(uint8_t* parent)
+{
+  const auto id = dstree_::dictionary_id(parent);
+  return id ? dstree_::find_dictionary(id) : nullptr;
+}
+
+const dstree_::dictionary_data* loaded_dictionary(uint8_t* parent)
+{
+  auto d = tree_dictionary(parent);
+  if (!d)
+    throw std::runtime_error("dictionary of the tree isn't loaded");
+  return d;
+}
+
+bool private_string(const dstree_::node_value& v)
+{
+  return v.t == dstree_::node_value::type::string_index &&
+    !(v.data.string_index & dstree_::node_value::dictionary_flag);
+}
+
+// Adds delta to the subtree sizes of the node and all its ancestors
+void add_subtree_size(uint8_t* parent, uint64_t node_id, int64_t delta)
+{
+  auto nodes = get_node_array(parent).data();
+  for (auto i = node_id; i != dstree_::node().parent_node;
+       i = nodes[i].parent_node)
+    nodes[i].subtree_size += delta;
+}
+
+bool subtree_sizes_kept(uint8_t* parent)
+{
+  return get_header(parent).flags &
+    (dstree_::header::preorder_flag | dstree_::header::subtree_sizes_flag);
+}
+
+// Sets subtree sizes of the subtree bottom up, children are queued after
+// their parents so the queue read backwards visits children first
+uint64_t count_subtree(uint8_t* parent, uint64_t node_id)
+{
+  auto nodes = get_node_array(parent).data();
+  std::vector<uint64_t> queue{ node_id };
+  for (size_t i = 0; i < queue.size(); ++i) {
+    auto [begin, end] = dstree_::get_valid_childs_range(parent, queue[i]);
+    for (auto it = begin; it != end; ++it)
+      queue.push_back(it->node_id);
+  }
+  for (auto i = queue.size(); i-- > 0;) {
+    auto& n = nodes[queue[i]];
+    n.subtree_size = 1;
+    auto [begin, end] = dstree_::get_valid_childs_range(parent, queue[i]);
+    for (auto it = begin; it != end; ++it)
+      n.subtree_size += nodes[it->node_id].subtree_size;
+  }
+  return nodes[node_id].subtree_size;
+}
+
+void prefetch(const void* p)
+{
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+  _mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#elif defined(__GNUC__)
+  __builtin_prefetch(p);
+#endif
+}
 }
 
-void dstree_::init_empty_tree(std::vector<uint8_t>& parent)
+void dstree_::init_empty_tree(dstree_::buffer& parent)
 {
   parent.clear();
   parent.resize(
     header::struct_size + 3 * array<int>::struct_size + node::struct_size, 0);
   auto h = reinterpret_cast<header*>(parent.data());
   *h = header();
+  h->flags = header::subtree_sizes_flag;
 }
 
 dstree_::node* dstree_::get_node(uint8_t* parent, uint64_t node_id)
@@ -54,7 +222,11 @@ dstree_::node* dstree_::get_node(uint8_t* parent, uint64_t node_id)
 }
 
 namespace {
-void resize_node_array_if_need(std::vector<uint8_t>& parent)
+bool subtree_hashes_enabled(uint8_t* parent);
+void resize_subtree_hashes(dstree_::buffer& parent);
+void mark_dirty(uint8_t* parent, uint64_t node_id);
+
+void resize_node_array_if_need(dstree_::buffer& parent)
 {
   auto node_array = &get_node_array(parent.data());
   auto header = &get_header(parent.data());
@@ -69,124 +241,180 @@ void resize_node_array_if_need(std::vector<uint8_t>& parent)
   header = &get_header(parent.data());
   for (auto i = prev_size; i < new_size; ++i)
     node_array->data()[i] = dstree_::node();
-  ++header->node_array_growth_factor;
+  resize_subtree_hashes(parent);
 }
 
-uint64_t allocate_node(std::vector<uint8_t>& parent)
+uint64_t allocate_node(dstree_::buffer& parent)
 {
   auto node_array = &get_node_array(parent.data());
   auto header = &get_header(parent.data());
   auto res = header->free_node_id;
   header->free_node_id++;
-  while (1) {
-    if (node_array->size >= header->free_node_id)
-      break;
-    if (!node_array->data()[header->free_node_id].valid)
-      break;
+  while (header->free_node_id < node_array->size &&
+         node_array->data()[header->free_node_id].valid)
     ++header->free_node_id;
-  }
   node_array->data()[res].valid = true;
   return res;
 }
 }
 
-uint64_t dstree_::create_node(std::vector<uint8_t>& parent)
+namespace {
+void global_index_add(dstree_::buffer& parent, uint64_t node_id);
+void global_index_remove(uint8_t* parent, uint64_t node_id);
+void thaw(uint8_t* parent, uint64_t node_id);
+}
+
+uint64_t dstree_::create_node(dstree_::buffer& parent)
 {
+  get_header(parent.data()).flags &= ~header::preorder_flag;
   resize_node_array_if_need(parent);
-  return allocate_node(parent);
+  const auto node_id = allocate_node(parent);
+  get_node(parent.data(), node_id)->subtree_size = 1;
+  global_index_add(parent, node_id);
+  return node_id;
 }
 
 namespace {
-void destroy_child_nodes(std::vector<uint8_t>& parent, uint64_t node_id)
+void destroy_subtree(dstree_::buffer& parent, uint64_t node_id);
+
+void destroy_child_nodes(dstree_::buffer& parent, uint64_t node_id)
 {
-  auto [child_begin, child_end] =
-    dstree_::get_valid_childs_range(parent.data(), node_id);
-  for (auto it = child_begin; it != child_end; ++it)
-    dstree_::destroy_node(parent, it->node_id);
+  // Every destroy_node call shrinks the range, so always take the last child
+  while (1) {
+    auto [child_begin, child_end] =
+      dstree_::get_valid_childs_range(parent.data(), node_id);
+    if (child_begin == child_end)
+      break;
+    destroy_subtree(parent, (child_end - 1)->node_id);
+  }
 }
 
-void erase_node_from_parent_node(std::vector<uint8_t>& parent,
-                                 uint64_t node_id)
+void erase_node_from_parent_node(dstree_::buffer& parent, uint64_t node_id)
 {
   auto& n = get_node_array(parent.data()).data()[node_id];
   if (n.parent_node == dstree_::node().parent_node)
     return;
 
+  thaw(parent.data(), n.parent_node);
+  mark_dirty(parent.data(), n.parent_node);
   auto parent_node = dstree_::get_node(parent.data(), n.parent_node);
-  auto& child_array = get_child_array(parent.data());
-  for (auto
-         i = parent_node->child_nodes_begin,
-         end = parent_node->child_nodes_begin + parent_node->child_nodes_size;
-       i < end; ++i) {
-    auto& ch = child_array.data()[i];
-    if (ch.node_id == node_id) {
-      ch.node_id = ~0;
-      break;
-    }
-  }
-  std::sort(&child_array.data()[parent_node->child_nodes_begin],
-            &child_array.data()[parent_node->child_nodes_begin +
-                                parent_node->child_nodes_size]);
+  auto [begin, end] =
+    dstree_::get_valid_childs_range(parent.data(), n.parent_node);
+  auto it = std::find_if(begin, end, [&](const dstree_::child& ch) {
+    return ch.node_id == node_id;
+  });
+  if (it == end)
+    return;
+  std::copy(it + 1, end, it);
+  (end - 1)->node_id = dstree_::child().node_id;
   parent_node->child_nodes_size--;
 }
 }
 
-void dstree_::destroy_node(std::vector<uint8_t>& parent, uint64_t node_id)
+namespace {
+void reserve_released_strings(dstree_::buffer& parent, uint64_t count);
+}
+
+void dstree_::destroy_node(dstree_::buffer& parent, uint64_t node_id)
+{
+  uint64_t strings = 0;
+  walk(parent.data(), node_id, [&](uint64_t id, size_t) {
+    strings += private_string(get_node(parent.data(), id)->value);
+    return true;
+  });
+  reserve_released_strings(parent, strings);
+
+  get_header(parent.data()).flags &= ~header::preorder_flag;
+  // Sizes inside the subtree don't matter, only its ancestors are updated
+  auto n = get_node(parent.data(), node_id);
+  if (n->parent_node != node().parent_node)
+    add_subtree_size(parent.data(), n->parent_node,
+                     -static_cast<int64_t>(n->subtree_size));
+  destroy_subtree(parent, node_id);
+}
+
+namespace {
+void destroy_subtree(dstree_::buffer& parent, uint64_t node_id)
 {
   destroy_child_nodes(parent, node_id);
+  global_index_remove(parent.data(), node_id);
+  thaw(parent.data(), node_id);
 
   auto node_array = &get_node_array(parent.data());
   auto header = &get_header(parent.data());
   auto& n = node_array->data()[node_id];
 
   erase_node_from_parent_node(parent, node_id);
+  dstree_::free_child_range(parent, n.child_nodes_begin,
+                            n.child_nodes_capacity);
 
-  n = node();
+  // Generation outlives the node so handles to it can detect the reuse
+  const auto value = n.value;
+  const auto generation = n.generation + 1;
+  n = dstree_::node();
+  n.generation = generation;
+  if (subtree_hashes_enabled(parent.data()))
+    get_subtree_hashes_array(parent.data()).data()[node_id] = 0;
   if (node_id < header->free_node_id)
     header->free_node_id = node_id;
+  if (private_string(value))
+    dstree_::destroy_string(parent, value.data.string_index);
+}
 }
 
 namespace {
-void insert_sorted(dstree_::child* arr, int64_t n, uint64_t key, int capacity)
+dstree_::lookup_key child_key(uint8_t* parent, const dstree_::child& ch)
+{
+  return dstree_::to_lookup_key(
+    parent, get_node_array(parent).data()[ch.node_id].value);
+}
+
+// Equal keys keep their insertion order
+void insert_sorted(uint8_t* parent, dstree_::child* arr, int64_t n,
+                   uint64_t child_node_id, int capacity)
 {
   if (n >= capacity)
     return;
 
-  int64_t i;
-  for (i = n - 1; (i >= 0 && arr[i].node_id > key); i--)
-    arr[i + 1] = arr[i];
-
-  arr[i + 1].node_id = key;
+  dstree_::child ch;
+  ch.node_id = child_node_id;
+  const auto key = child_key(parent, ch);
+  const auto pos = std::partition_point(
+    arr, arr + n, [&](const dstree_::child& other) {
+      return dstree_::compare_keys(child_key(parent, other), key) <= 0;
+    });
+  std::copy_backward(pos, arr + n, arr + n + 1);
+  pos->node_id = child_node_id;
 }
 
-uint64_t create_child_node(std::vector<uint8_t>& parent, uint64_t node_id,
+void reposition_child(uint8_t* parent, uint64_t node_id);
+
+uint64_t create_child_node(dstree_::buffer& parent, uint64_t node_id,
                            const dstree_::node_value& value)
 {
   auto child_node_id = dstree_::create_node(parent);
-  auto child = dstree_::get_node(parent.data(), child_node_id);
-  child->value = value;
-  child->parent_node = node_id;
+  dstree_::set_value(parent, child_node_id, value);
+  dstree_::get_node(parent.data(), child_node_id)->parent_node = node_id;
   return child_node_id;
 }
 
-void increase_child_range_size(std::vector<uint8_t>& parent,
+void increase_child_range_size(dstree_::buffer& parent,
                                dstree_::node* node, uint64_t node_id)
 {
   dstree_::free_child_range(parent, node->child_nodes_begin,
                             node->child_nodes_capacity);
-  auto& header = get_header(parent.data());
   const auto new_capacity = (1 + node->child_nodes_capacity) *
-    static_cast<uint32_t>(pow(2, header.node_array_growth_factor));
+    static_cast<uint32_t>(
+      pow(2, get_header(parent.data()).childs_array_growth_factor));
   const auto new_range_begin =
     dstree_::allocate_child_range(parent, new_capacity);
-  header.node_array_growth_factor++;
 
   node = dstree_::get_node(parent.data(), node_id);
   node->child_nodes_begin = new_range_begin;
   node->child_nodes_capacity = new_capacity;
 }
 
-void resize_child_range_if_need(std::vector<uint8_t>& parent, uint64_t node_id)
+void resize_child_range_if_need(dstree_::buffer& parent, uint64_t node_id)
 {
   auto& child_array = get_child_array(parent.data());
   auto node = dstree_::get_node(parent.data(), node_id);
@@ -207,7 +435,7 @@ void resize_child_range_if_need(std::vector<uint8_t>& parent, uint64_t node_id)
     child_arr.data()[node->child_nodes_begin + i] = backup[i];
 }
 
-void calculate_child_nodes_size(std::vector<uint8_t>& parent, uint64_t node_id)
+void calculate_child_nodes_size(dstree_::buffer& parent, uint64_t node_id)
 {
   auto& child_array = get_child_array(parent.data());
   auto node = dstree_::get_node(parent.data(), node_id);
@@ -219,12 +447,12 @@ void calculate_child_nodes_size(std::vector<uint8_t>& parent, uint64_t node_id)
   }
 }
 
-void add_child(std::vector<uint8_t>& parent, uint64_t node_id,
+void add_child(dstree_::buffer& parent, uint64_t node_id,
                uint64_t child_node_id)
 {
   auto& child_array = get_child_array(parent.data());
   auto node = dstree_::get_node(parent.data(), node_id);
-  insert_sorted(&child_array.data()[node->child_nodes_begin],
+  insert_sorted(parent.data(), &child_array.data()[node->child_nodes_begin],
                 node->child_nodes_size, child_node_id,
                 node->child_nodes_capacity);
 
@@ -232,25 +460,28 @@ void add_child(std::vector<uint8_t>& parent, uint64_t node_id,
 }
 }
 
-uint64_t dstree_::insert(std::vector<uint8_t>& parent, uint64_t node_id,
+uint64_t dstree_::insert(dstree_::buffer& parent, uint64_t node_id,
                          const node_value& value)
 {
   const auto child_node_id = create_child_node(parent, node_id, value);
+  thaw(parent.data(), node_id);
+  mark_dirty(parent.data(), node_id);
   resize_child_range_if_need(parent, node_id);
   calculate_child_nodes_size(parent, node_id);
   add_child(parent, node_id, child_node_id);
+  add_subtree_size(parent.data(), node_id, 1);
   return child_node_id;
 }
 
 namespace {
-uint64_t try_allocate_in_existing_region(std::vector<uint8_t>& parent,
+uint64_t try_allocate_in_existing_region(dstree_::buffer& parent,
                                          uint32_t size)
 {
   auto& child_array = get_child_array(parent.data());
   const auto n = child_array.size;
-  uint64_t pos = ~0;
+  uint64_t pos = ~0ULL;
   if (n >= size)
-    for (uint64_t i = 0; i < n - size; ++i) {
+    for (uint64_t i = 0; i <= n - size && pos == ~0ULL; ++i) {
       bool region_in_use = false;
       for (uint32_t j = 0; j < size; ++j) {
         if (child_array.data()[i + j].allocated) {
@@ -270,8 +501,7 @@ uint64_t try_allocate_in_existing_region(std::vector<uint8_t>& parent,
   return pos;
 }
 
-uint64_t extend_region_and_allocate(std::vector<uint8_t>& parent,
-                                    uint32_t size)
+uint64_t extend_region_and_allocate(dstree_::buffer& parent, uint32_t size)
 {
   auto& child_array = get_child_array(parent.data());
   auto prev_size = child_array.size;
@@ -286,17 +516,17 @@ uint64_t extend_region_and_allocate(std::vector<uint8_t>& parent,
 }
 }
 
-uint64_t dstree_::allocate_child_range(std::vector<uint8_t>& parent,
-                                       uint32_t size)
+uint64_t dstree_::allocate_child_range(dstree_::buffer& parent, uint32_t size)
 {
+  DSTREE_MEASURE(allocate_child_range);
   auto& child_array = get_child_array(parent.data());
   const auto n = child_array.size;
 
   auto pos = try_allocate_in_existing_region(parent, size);
-  return pos != ~0 ? pos : extend_region_and_allocate(parent, size);
+  return pos != ~0ULL ? pos : extend_region_and_allocate(parent, size);
 }
 
-void dstree_::free_child_range(std::vector<uint8_t>& parent, uint64_t begin,
+void dstree_::free_child_range(dstree_::buffer& parent, uint64_t begin,
                                uint32_t size)
 {
   if (size) {
@@ -317,41 +547,157 @@ std::pair<dstree_::child*, dstree_::child*> dstree_::get_valid_childs_range(
   return { begin, end };
 }
 
-void dstree_::set_value(uint8_t* parent, uint64_t node_id,
+namespace {
+void global_index_place(uint8_t* parent, uint64_t node_id);
+}
+
+void dstree_::set_value(buffer& parent, uint64_t node_id,
                         node_value new_value)
 {
-  if (auto n = get_node(parent, node_id))
-    n->value = new_value;
+  auto n = get_node(parent.data(), node_id);
+  if (!n)
+    return;
+  const auto old_value = n->value;
+  const bool release = private_string(old_value) &&
+    !(private_string(new_value) &&
+      new_value.data.string_index == old_value.data.string_index);
+  if (release)
+    reserve_released_strings(parent, 1);
+
+  auto data = parent.data();
+  n = get_node(data, node_id);
+  // Node keeps its slot count in the global index, so no growth is needed
+  global_index_remove(data, node_id);
+  n->value = new_value;
+  global_index_place(data, node_id);
+  mark_dirty(data, node_id);
+  if (n->parent_node != node().parent_node) {
+    // The new key may move the node among its siblings
+    get_header(data).flags &= ~header::preorder_flag;
+    thaw(data, n->parent_node);
+    reposition_child(data, node_id);
+  }
+  if (release)
+    destroy_string(parent, old_value.data.string_index);
+}
+
+// Released strings are kept as extents sorted by position, neighbouring
+// extents are merged
+namespace {
+// Changes reserve room for the extents they release before they start, so
+// releasing them neither allocates nor fails halfway through the change
+void reserve_released_strings(dstree_::buffer& parent, uint64_t count)
+{
+  if (!count)
+    return;
+  if (!free_strings_kept(parent.data())) {
+    const auto tables_end = extra_tables_end(parent.data());
+    parent.resize(tables_end);
+    parent.resize(tables_end + dstree_::array<uint8_t>::struct_size, 0);
+    get_header(parent.data()).flags |= dstree_::header::free_strings_flag;
+  }
+  parent.reserve(parent.size() + count * dstree_::string_extent::struct_size);
+}
+
+uint64_t take_free_string(dstree_::buffer& parent, uint64_t size)
+{
+  if (!free_strings_kept(parent.data()))
+    return ~0ULL;
+  auto& arr = get_free_strings_array(parent.data());
+  auto extents = arr.data();
+  for (uint64_t i = 0; i < arr.size; ++i) {
+    auto& e = extents[i];
+    if (e.size < size)
+      continue;
+    const auto pos = e.begin;
+    e.begin += size;
+    e.size -= size;
+    if (!e.size) {
+      std::copy(extents + i + 1, extents + arr.size, extents + i);
+      arr.resize(arr.size - 1, parent);
+    }
+    return pos;
+  }
+  return ~0ULL;
+}
+
+void release_string(dstree_::buffer& parent, dstree_::string_extent freed)
+{
+  auto arr = &get_free_strings_array(parent.data());
+  auto extents = arr->data();
+  const uint64_t n = arr->size;
+  const uint64_t i = std::partition_point(
+                       extents, extents + n,
+                       [&](const dstree_::string_extent& e) {
+                         return e.begin < freed.begin;
+                       }) -
+    extents;
+  const bool merge_prev =
+    i > 0 && extents[i - 1].begin + extents[i - 1].size == freed.begin;
+  const bool merge_next =
+    i < n && freed.begin + freed.size == extents[i].begin;
+
+  if (merge_prev && merge_next) {
+    extents[i - 1].size += freed.size + extents[i].size;
+    std::copy(extents + i + 1, extents + n, extents + i);
+    arr->resize(n - 1, parent);
+  } else if (merge_prev) {
+    extents[i - 1].size += freed.size;
+  } else if (merge_next) {
+    extents[i].begin = freed.begin;
+    extents[i].size += freed.size;
+  } else {
+    arr->resize(n + 1, parent);
+    extents = get_free_strings_array(parent.data()).data();
+    std::copy_backward(extents + i, extents + n, extents + n + 1);
+    extents[i] = freed;
+  }
+}
+
+// For changes that rebuild the string table
+void drop_free_strings(dstree_::buffer& parent)
+{
+  if (!free_strings_kept(parent.data()))
+    return;
+  parent.resize(extra_tables_end(parent.data()));
+  get_header(parent.data()).flags &= ~dstree_::header::free_strings_flag;
+}
 }
 
-uint64_t dstree_::create_string(std::vector<uint8_t>& parent, const char* str)
+uint64_t dstree_::create_string(dstree_::buffer& parent, const char* str)
 {
+  if (auto d = tree_dictionary(parent.data())) {
+    const auto i = d->find(str);
+    if (i != ~0ULL)
+      return i | node_value::dictionary_flag;
+  }
+
+  // The first released extent that fits is reused, otherwise the string is
+  // appended
   auto str_size = strlen(str) + 1;
-  while (1) {
+  auto pos = take_free_string(parent, str_size);
+  if (pos == ~0ULL) {
     auto arr = &get_string_array(parent.data());
-    if (arr->size >= str_size) {
-      auto arr_data = arr->data();
-      for (int i = 0; i < arr->size - str_size; ++i) {
-        if (std::all_of(&arr_data[i], &arr_data[i] + str_size,
-                        [](uint8_t byte) { return !byte; })) {
-          memcpy(&arr_data[i], str, str_size);
-          return i;
-        }
-      }
-    }
+    pos = arr->size;
     arr->resize(arr->size + str_size, parent);
   }
+  memcpy(&get_string_array(parent.data()).data()[pos], str, str_size);
+  return pos;
 }
 
-void dstree_::destroy_string(std::vector<uint8_t>& parent, uint64_t pos)
+void dstree_::destroy_string(dstree_::buffer& parent, uint64_t pos)
 {
   auto& arr = get_string_array(parent.data());
-  for (uint64_t i = pos; arr.data()[i]; ++i)
-    arr.data()[i] = 0;
+  const auto size = strlen(&arr.data()[pos]) + 1;
+  std::fill_n(&arr.data()[pos], size, 0);
+  reserve_released_strings(parent, 1);
+  release_string(parent, { pos, size });
 }
 
 const char* dstree_::get_string(uint8_t* parent, uint64_t pos)
 {
+  if (pos & node_value::dictionary_flag)
+    return loaded_dictionary(parent)->get(pos & ~node_value::dictionary_flag);
   return &get_string_array(parent).data()[pos];
 }
 
@@ -360,21 +706,1962 @@ dstree_::node_value::node_value() noexcept
 {
 }
 
-dstree_::node_value::node_value(int64_t value, std::vector<uint8_t>*) noexcept
+dstree_::node_value::node_value(int64_t value, dstree_::buffer*) noexcept
 {
   t = type::integer;
   data.integer = value;
 }
 
-dstree_::node_value::node_value(double value, std::vector<uint8_t>*) noexcept
+dstree_::node_value::node_value(double value, dstree_::buffer*) noexcept
 {
   t = type::floating_point;
   data.floating_point = value;
 }
 
 dstree_::node_value::node_value(const char* value,
-                                std::vector<uint8_t>* parent) noexcept
+                                dstree_::buffer* parent) noexcept
 {
   t = type::string_index;
   data.string_index = dstree_::create_string(*parent, value);
-}
\ No newline at end of file
+}
+dstree_::lookup_key dstree_::to_lookup_key(uint8_t* parent,
+                                           const node_value& value)
+{
+  lookup_key res;
+  res.t = value.t;
+  if (value.t == node_value::type::integer) {
+    res.data.integer = value.data.integer;
+  } else if (value.t == node_value::type::floating_point) {
+    res.data.floating_point = value.data.floating_point;
+  } else if (private_string(value)) {
+    res.data.string = get_string(parent, value.data.string_index);
+  } else {
+    res.dictionary = loaded_dictionary(parent);
+    res.string_id = value.data.string_index & ~node_value::dictionary_flag;
+    res.data.string = res.dictionary->get(res.string_id);
+  }
+  return res;
+}
+
+bool dstree_::value_equals(uint8_t* parent, const node_value& value,
+                           const lookup_key& k)
+{
+  if (value.t != k.t)
+    return false;
+  switch (k.t) {
+    case node_value::type::integer:
+      return value.data.integer == k.data.integer;
+    case node_value::type::floating_point:
+      return value.data.floating_point == k.data.floating_point;
+    case node_value::type::string_index:
+      return !compare_keys(to_lookup_key(parent, value), k);
+  }
+  return false;
+}
+
+namespace {
+uint64_t mix(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+}
+
+uint64_t dstree_::key_hash(const lookup_key& k)
+{
+  uint64_t bits = 0;
+  switch (k.t) {
+    case node_value::type::integer:
+      bits = static_cast<uint64_t>(k.data.integer);
+      break;
+    case node_value::type::floating_point: {
+      // 0.0 and -0.0 compare equal and so must hash equal
+      double v = k.data.floating_point == 0 ? 0 : k.data.floating_point;
+      memcpy(&bits, &v, sizeof(bits));
+      break;
+    }
+    case node_value::type::string_index:
+      bits = 0xcbf29ce484222325ULL;
+      for (auto p = k.data.string; *p; ++p)
+        bits = (bits ^ static_cast<uint8_t>(*p)) * 0x100000001b3ULL;
+      break;
+  }
+  return mix(bits + static_cast<uint64_t>(k.t));
+}
+
+// Global index is an open addressing hash table of node ids keyed by node
+// value. First element of the table is the number of stored ids, the rest are
+// slots. The table is empty when the index is disabled.
+namespace {
+constexpr uint64_t empty_slot = ~0ULL;
+
+bool global_index_enabled(uint8_t* parent)
+{
+  return get_header(parent).extra_tables > 0 &&
+    get_global_index_array(parent).size > 0;
+}
+
+uint64_t node_hash(uint8_t* parent, uint64_t node_id)
+{
+  return dstree_::key_hash(dstree_::to_lookup_key(
+    parent, get_node_array(parent).data()[node_id].value));
+}
+
+void global_index_place(uint8_t* parent, uint64_t node_id)
+{
+  if (!global_index_enabled(parent))
+    return;
+  auto& arr = get_global_index_array(parent);
+  auto slots = arr.data() + 1;
+  const auto mask = arr.size - 2;
+  auto i = node_hash(parent, node_id) & mask;
+  while (slots[i] != empty_slot)
+    i = (i + 1) & mask;
+  slots[i] = node_id;
+  ++arr.data()[0];
+}
+
+void global_index_rehash(dstree_::buffer& parent, uint64_t capacity)
+{
+  auto arr = &get_global_index_array(parent.data());
+  std::vector<uint64_t> ids;
+  if (arr->size > 0)
+    std::copy_if(arr->data() + 1, arr->data() + arr->size,
+                 std::back_inserter(ids),
+                 [](uint64_t id) { return id != empty_slot; });
+
+  arr->resize(1 + capacity, parent);
+  arr = &get_global_index_array(parent.data());
+  arr->data()[0] = 0;
+  std::fill(arr->data() + 1, arr->data() + arr->size, empty_slot);
+  for (auto id : ids)
+    global_index_place(parent.data(), id);
+}
+
+void global_index_add(dstree_::buffer& parent, uint64_t node_id)
+{
+  if (!global_index_enabled(parent.data()))
+    return;
+  auto& arr = get_global_index_array(parent.data());
+  const auto capacity = arr.size - 1;
+  if ((arr.data()[0] + 1) * 2 > capacity)
+    global_index_rehash(parent, capacity * 2);
+  global_index_place(parent.data(), node_id);
+}
+
+void global_index_remove(uint8_t* parent, uint64_t node_id)
+{
+  if (!global_index_enabled(parent))
+    return;
+  auto& arr = get_global_index_array(parent);
+  auto slots = arr.data() + 1;
+  const auto mask = arr.size - 2;
+  auto i = node_hash(parent, node_id) & mask;
+  while (slots[i] != node_id) {
+    if (slots[i] == empty_slot)
+      return;
+    i = (i + 1) & mask;
+  }
+
+  // Backward shift deletion keeps probe sequences free of holes
+  for (auto j = (i + 1) & mask; slots[j] != empty_slot; j = (j + 1) & mask) {
+    const auto home = node_hash(parent, slots[j]) & mask;
+    const bool movable = i <= j ? (home <= i || home > j)
+                                : (home <= i && home > j);
+    if (movable) {
+      slots[i] = slots[j];
+      i = j;
+    }
+  }
+  slots[i] = empty_slot;
+  --arr.data()[0];
+}
+}
+
+void dstree_::enable_global_index(dstree_::buffer& parent)
+{
+  if (global_index_enabled(parent.data()))
+    return;
+  ensure_extra_tables(parent, 1);
+
+  auto& node_array = get_node_array(parent.data());
+  uint64_t capacity = 8;
+  while (capacity < node_array.size * 2)
+    capacity *= 2;
+  global_index_rehash(parent, capacity);
+
+  for (uint64_t i = 0; i < get_node_array(parent.data()).size; ++i)
+    if (get_node_array(parent.data()).data()[i].valid)
+      global_index_add(parent, i);
+}
+
+bool dstree_::has_global_index(uint8_t* parent)
+{
+  return global_index_enabled(parent);
+}
+
+std::vector<uint64_t> dstree_::find_all_global(uint8_t* parent,
+                                               const lookup_key& k)
+{
+  std::vector<uint64_t> res;
+  auto& node_array = get_node_array(parent);
+
+  if (!global_index_enabled(parent)) {
+    for (uint64_t i = 0; i < node_array.size; ++i) {
+      auto& n = node_array.data()[i];
+      if (n.valid && value_equals(parent, n.value, k))
+        res.push_back(i);
+    }
+    return res;
+  }
+
+  auto& arr = get_global_index_array(parent);
+  auto slots = arr.data() + 1;
+  const auto mask = arr.size - 2;
+  for (auto i = key_hash(k) & mask; slots[i] != empty_slot;
+       i = (i + 1) & mask)
+    if (value_equals(parent, node_array.data()[slots[i]].value, k))
+      res.push_back(slots[i]);
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+
+int dstree_::compare_keys(const lookup_key& lhs, const lookup_key& rhs)
+{
+  if (lhs.t != rhs.t)
+    return lhs.t < rhs.t ? -1 : 1;
+  switch (lhs.t) {
+    case node_value::type::integer:
+      return (lhs.data.integer > rhs.data.integer) -
+        (lhs.data.integer < rhs.data.integer);
+    case node_value::type::floating_point: {
+      // NaNs go after all other numbers
+      const auto l = lhs.data.floating_point, r = rhs.data.floating_point;
+      if (std::isnan(l) || std::isnan(r))
+        return std::isnan(l) - std::isnan(r);
+      return (l > r) - (l < r);
+    }
+    case node_value::type::string_index:
+      // Dictionaries are sorted, so ids compare like their strings
+      if (lhs.dictionary && lhs.dictionary == rhs.dictionary)
+        return (lhs.string_id > rhs.string_id) -
+          (lhs.string_id < rhs.string_id);
+      return strcmp(lhs.data.string, rhs.data.string);
+  }
+  return 0;
+}
+
+// Frozen ranges are read-optimized copies of large child ranges. Children
+// are sorted by key and laid out in Eytzinger (BFS) order with keys inlined,
+// so lookups touch neither the node table nor unrelated cache lines.
+namespace {
+bool frozen_enabled(uint8_t* parent)
+{
+  return get_header(parent).extra_tables > 2 &&
+    get_frozen_ranges_array(parent).size > 0;
+}
+
+dstree_::frozen_range* find_frozen_range(uint8_t* parent, uint64_t node_id)
+{
+  if (!frozen_enabled(parent))
+    return nullptr;
+  auto& ranges = get_frozen_ranges_array(parent);
+  auto end = ranges.data() + ranges.size;
+  auto it = std::lower_bound(ranges.data(), end, node_id,
+                             [](const dstree_::frozen_range& r, uint64_t id) {
+                               return r.node_id < id;
+                             });
+  if (it == end || it->node_id != node_id || !it->size)
+    return nullptr;
+  return it;
+}
+
+void thaw(uint8_t* parent, uint64_t node_id)
+{
+  if (auto range = find_frozen_range(parent, node_id))
+    range->size = 0;
+}
+
+void build_eytzinger(const std::vector<dstree_::frozen_child>& sorted,
+                     dstree_::frozen_child* out, size_t& i, size_t k)
+{
+  if (k > sorted.size())
+    return;
+  build_eytzinger(sorted, out, i, 2 * k);
+  out[k - 1] = sorted[i++];
+  build_eytzinger(sorted, out, i, 2 * k + 1);
+}
+
+uint64_t find_frozen_child(uint8_t* parent, const dstree_::frozen_range& range,
+                           const dstree_::lookup_key& k)
+{
+  auto b = get_frozen_childs_array(parent).data() + range.begin;
+  const auto n = range.size;
+
+  uint64_t i = 1;
+  while (i <= n) {
+    if (4 * i <= n)
+      prefetch(&b[4 * i - 1]);
+    const auto key = dstree_::to_lookup_key(parent, b[i - 1].value);
+    i = 2 * i + (dstree_::compare_keys(key, k) < 0);
+  }
+  // Strip the right turns made after the last left turn
+  while (i & 1)
+    i >>= 1;
+  i >>= 1;
+
+  if (i == 0 || !dstree_::value_equals(parent, b[i - 1].value, k))
+    return ~0;
+  return b[i - 1].node_id;
+}
+}
+
+namespace {
+// Strings found in the dictionary of the tree are compared by id
+dstree_::lookup_key encode_key(uint8_t* parent, dstree_::lookup_key k)
+{
+  if (k.t != dstree_::node_value::type::string_index || k.dictionary)
+    return k;
+  if (auto d = tree_dictionary(parent)) {
+    const auto i = d->find(k.data.string);
+    if (i != ~0ULL) {
+      k.dictionary = d;
+      k.string_id = i;
+    }
+  }
+  return k;
+}
+}
+
+uint64_t dstree_::find_child(uint8_t* parent, uint64_t node_id,
+                             const lookup_key& key)
+{
+  const auto k = encode_key(parent, key);
+  if (auto range = find_frozen_range(parent, node_id))
+    return find_frozen_child(parent, *range, k);
+
+  auto& node_array = get_node_array(parent);
+  auto [begin, end] = get_valid_childs_range(parent, node_id);
+  if (childs_ordered(parent))
+    begin += lower_bound(parent, node_id, k);
+  for (auto it = begin; it != end; ++it) {
+    if (value_equals(parent, node_array.data()[it->node_id].value, k))
+      return it->node_id;
+    if (childs_ordered(parent))
+      break;
+  }
+  return ~0;
+}
+
+// Searches of a group advance in lockstep, one stage per memory access of a
+// binary search step, so each stage prefetches what the next one reads and
+// the misses of all searches in the group overlap
+namespace {
+struct group_search
+{
+  const dstree_::child* childs = nullptr;
+  const dstree_::frozen_child* frozen = nullptr;
+  uint64_t lo = 0, hi = 0, size = 0;
+  uint64_t probe = 0;
+  bool hi_equal = false;
+  bool done = false;
+  dstree_::lookup_key probe_key;
+};
+
+constexpr size_t search_group_size = 16;
+
+void search_group(uint8_t* parent, const uint64_t* node_ids,
+                  const dstree_::lookup_key* keys, size_t n, uint64_t* out)
+{
+  group_search s[search_group_size];
+  auto nodes = get_node_array(parent).data();
+  auto childs = get_child_array(parent).data();
+
+  for (size_t j = 0; j < n; ++j)
+    prefetch(&nodes[node_ids[j]]);
+  for (size_t j = 0; j < n; ++j) {
+    out[j] = ~0ULL;
+    if (auto range = find_frozen_range(parent, node_ids[j])) {
+      s[j].frozen = get_frozen_childs_array(parent).data() + range->begin;
+      s[j].size = range->size;
+      s[j].lo = 1;
+    } else {
+      auto& node = nodes[node_ids[j]];
+      s[j].childs = childs + node.child_nodes_begin;
+      s[j].size = s[j].hi = node.child_nodes_size;
+    }
+  }
+
+  size_t active = n;
+  while (active) {
+    // Position of the probe, the child slot or the frozen entry is fetched
+    for (size_t j = 0; j < n; ++j) {
+      auto& c = s[j];
+      if (c.done)
+        continue;
+      if (c.frozen ? c.lo > c.size : c.lo >= c.hi) {
+        c.done = true;
+        --active;
+        if (c.frozen) {
+          // Strip the right turns made after the last left turn
+          auto i = c.lo;
+          while (i & 1)
+            i >>= 1;
+          i >>= 1;
+          if (i && c.hi_equal)
+            out[j] = c.frozen[i - 1].node_id;
+        } else if (c.hi_equal) {
+          out[j] = c.childs[c.lo].node_id;
+        }
+        continue;
+      }
+      c.probe = c.frozen ? c.lo - 1 : (c.lo + c.hi) / 2;
+      prefetch(c.frozen ? static_cast<const void*>(&c.frozen[c.probe])
+                        : &c.childs[c.probe]);
+    }
+    // The node of the probed child
+    for (size_t j = 0; j < n; ++j)
+      if (!s[j].done && !s[j].frozen)
+        prefetch(&nodes[s[j].childs[s[j].probe].node_id]);
+    // The string of the probed key
+    for (size_t j = 0; j < n; ++j) {
+      auto& c = s[j];
+      if (c.done)
+        continue;
+      c.probe_key = dstree_::to_lookup_key(
+        parent,
+        c.frozen ? c.frozen[c.probe].value
+                 : nodes[c.childs[c.probe].node_id].value);
+      if (c.probe_key.t == dstree_::node_value::type::string_index)
+        prefetch(c.probe_key.data.string);
+    }
+    for (size_t j = 0; j < n; ++j) {
+      auto& c = s[j];
+      if (c.done)
+        continue;
+      const auto cmp = dstree_::compare_keys(c.probe_key, keys[j]);
+      if (c.frozen) {
+        if (cmp < 0) {
+          c.lo = 2 * c.lo + 1;
+        } else {
+          c.lo = 2 * c.lo;
+          c.hi_equal = cmp == 0 && dstree_::value_equals(
+                                     parent, c.frozen[c.probe].value, keys[j]);
+        }
+      } else if (cmp < 0) {
+        c.lo = c.probe + 1;
+      } else {
+        c.hi = c.probe;
+        c.hi_equal = cmp == 0 &&
+          dstree_::value_equals(
+            parent, nodes[c.childs[c.probe].node_id].value, keys[j]);
+      }
+    }
+  }
+}
+}
+
+void dstree_::find_children(uint8_t* parent, const uint64_t* node_ids,
+                            const lookup_key* keys, size_t n, uint64_t* out)
+{
+  if (!childs_ordered(parent)) {
+    for (size_t i = 0; i < n; ++i)
+      out[i] = find_child(parent, node_ids[i], keys[i]);
+    return;
+  }
+  dstree_::lookup_key group_keys[search_group_size];
+  for (size_t i = 0; i < n; i += search_group_size) {
+    const auto group = std::min(search_group_size, n - i);
+    for (size_t j = 0; j < group; ++j)
+      group_keys[j] = encode_key(parent, keys[i + j]);
+    search_group(parent, node_ids + i, group_keys, group, out + i);
+  }
+}
+
+bool dstree_::childs_ordered(uint8_t* parent)
+{
+  return get_header(parent).version >= header::ordered_childs_version;
+}
+
+void dstree_::sort_childs(uint8_t* parent, child* begin, child* end)
+{
+  std::stable_sort(begin, end, [&](const child& lhs, const child& rhs) {
+    return compare_keys(child_key(parent, lhs), child_key(parent, rhs)) < 0;
+  });
+}
+
+namespace {
+template <class T>
+const T* table(const uint8_t* data, const uint64_t* starts, size_t id)
+{
+  return reinterpret_cast<const T*>(data + starts[id]);
+}
+
+// Ids, child ranges and string offsets are checked before anything walks the
+// tree. Every valid node but the root must be listed once in the range of
+// its parent and be reachable from the root, so walks end.
+void check_tables(const uint8_t* data, const dstree_::header& h,
+                  const uint64_t* starts, const uint64_t* counts)
+{
+  using namespace dstree_;
+  auto corrupted = [] { throw std::runtime_error("corrupted tree"); };
+  const auto nodes = table<node>(data, starts, node_table_id.value);
+  const auto childs = table<child>(data, starts, child_table_id.value);
+  const auto strings = table<char>(data, starts, string_table_id.value);
+  const auto node_count = counts[node_table_id.value];
+  const auto child_count = counts[child_table_id.value];
+  const auto strings_size = counts[string_table_id.value];
+
+  // With a terminator at the end every offset in the table is a string
+  if (strings_size && strings[strings_size - 1])
+    corrupted();
+  auto check_value = [&](const node_value& v) {
+    if (v.t > node_value::type::string_index ||
+        (v.t == node_value::type::string_index &&
+         !(v.data.string_index & node_value::dictionary_flag) &&
+         v.data.string_index >= strings_size))
+      corrupted();
+  };
+
+  if (!nodes[0].valid || nodes[0].parent_node != node().parent_node ||
+      h.free_node_id > node_count ||
+      (h.free_node_id < node_count && nodes[h.free_node_id].valid))
+    corrupted();
+  std::vector<bool> listed(node_count);
+  uint64_t valid = 0;
+  for (uint64_t id = 0; id < node_count; ++id) {
+    const auto& n = nodes[id];
+    if (!n.valid)
+      continue;
+    ++valid;
+    check_value(n.value);
+    if (n.child_nodes_size > n.child_nodes_capacity ||
+        (n.child_nodes_capacity &&
+         (n.child_nodes_begin > child_count ||
+          n.child_nodes_capacity > child_count - n.child_nodes_begin)))
+      corrupted();
+    for (uint32_t i = 0; i < n.child_nodes_size; ++i) {
+      const auto child_id = childs[n.child_nodes_begin + i].node_id;
+      if (child_id >= node_count || listed[child_id] ||
+          !nodes[child_id].valid || nodes[child_id].parent_node != id)
+        corrupted();
+      listed[child_id] = true;
+    }
+  }
+
+  std::vector<uint64_t> stack{ 0 };
+  uint64_t reached = 0;
+  while (!stack.empty()) {
+    const auto& n = nodes[stack.back()];
+    stack.pop_back();
+    ++reached;
+    for (uint32_t i = 0; i < n.child_nodes_size; ++i)
+      stack.push_back(childs[n.child_nodes_begin + i].node_id);
+  }
+  if (reached != valid)
+    corrupted();
+
+  // Sizes are checked node by node, preorder layout also needs every child
+  // to follow the subtrees of the siblings before it. Images older than the
+  // sizes flag only have sizes in preorder layout.
+  const bool preorder = h.flags & header::preorder_flag;
+  const bool sizes = preorder || (h.flags & header::subtree_sizes_flag);
+  for (uint64_t id = 0; sizes && id < node_count; ++id) {
+    const auto& n = nodes[id];
+    if (!n.valid)
+      continue;
+    uint64_t size = 1;
+    for (uint32_t i = 0; i < n.child_nodes_size; ++i) {
+      const auto child_id = childs[n.child_nodes_begin + i].node_id;
+      if (preorder && child_id != id + size)
+        corrupted();
+      size += nodes[child_id].subtree_size;
+    }
+    if (n.subtree_size != size)
+      corrupted();
+  }
+
+  // The global index needs a free slot to end its probes
+  if (h.extra_tables > 0 && counts[global_index_table_id.value]) {
+    const auto index =
+      table<uint64_t>(data, starts, global_index_table_id.value);
+    const auto slots = counts[global_index_table_id.value] - 1;
+    if (slots == 0 || (slots & (slots - 1)))
+      corrupted();
+    uint64_t used = 0;
+    for (uint64_t i = 1; i <= slots; ++i) {
+      if (index[i] == empty_slot)
+        continue;
+      if (index[i] >= node_count || !nodes[index[i]].valid)
+        corrupted();
+      ++used;
+    }
+    if (used != index[0] || used == slots)
+      corrupted();
+  }
+
+  if (h.extra_tables > 2) {
+    const auto ranges =
+      table<frozen_range>(data, starts, frozen_ranges_table_id.value);
+    const auto frozen =
+      table<frozen_child>(data, starts, frozen_childs_table_id.value);
+    const auto frozen_count = counts[frozen_childs_table_id.value];
+    for (uint64_t i = 0; i < counts[frozen_ranges_table_id.value]; ++i) {
+      const auto& r = ranges[i];
+      if (r.node_id >= node_count || r.begin > frozen_count ||
+          r.size > frozen_count - r.begin)
+        corrupted();
+    }
+    for (uint64_t i = 0; i < frozen_count; ++i) {
+      check_value(frozen[i].value);
+      if (frozen[i].node_id >= node_count)
+        corrupted();
+    }
+  }
+
+  if (h.extra_tables > 3 && counts[subtree_hashes_table_id.value] &&
+      counts[subtree_hashes_table_id.value] != node_count)
+    corrupted();
+
+  if (h.flags & header::free_strings_flag) {
+    const size_t id = string_table_id.value + 1 + h.extra_tables;
+    const auto extents = table<string_extent>(data, starts, id);
+    for (uint64_t i = 0; i < counts[id]; ++i)
+      if (extents[i].begin > strings_size ||
+          extents[i].size > strings_size - extents[i].begin)
+        corrupted();
+  }
+}
+}
+
+void dstree_::check_image(const uint8_t* data, size_t length)
+{
+  header h;
+  if (length < header::struct_size)
+    throw std::runtime_error("corrupted tree");
+  memcpy(&h, data, header::struct_size);
+  if (h.version < 1 || h.version > header::current_version)
+    throw std::runtime_error("unsupported tree version " +
+                             std::to_string(h.version));
+
+  const auto& sizes = schema.array_element_sizes;
+  if (h.extra_tables > sizes.size() - 3)
+    throw std::runtime_error("corrupted tree");
+  const size_t extra_end = 3u + h.extra_tables;
+  const bool free_strings = h.flags & header::free_strings_flag;
+  // Start and element count of every table, the free strings table last
+  uint64_t starts[9] = {}, counts[9] = {};
+  uint64_t pos = header::struct_size;
+  for (size_t i = 0; i < extra_end + free_strings; ++i) {
+    const auto size = i < extra_end ? sizes[i] : string_extent::struct_size;
+    uint64_t n;
+    if (length - pos < array<int>::struct_size)
+      throw std::runtime_error("corrupted tree");
+    memcpy(&n, data + pos, sizeof(n));
+    pos += array<int>::struct_size;
+    if (n > (length - pos) / size || (i == 0 && n == 0))
+      throw std::runtime_error("corrupted tree");
+    starts[i] = pos;
+    counts[i] = n;
+    pos += n * size;
+  }
+  check_tables(data, h, starts, counts);
+}
+
+// Each step is a single pass over the tables, versions only ever add to the
+// layout so the image keeps its size
+void dstree_::upgrade(uint8_t* parent)
+{
+  auto& h = get_header(parent);
+  if (h.version < header::ordered_childs_version) {
+    auto& node_array = get_node_array(parent);
+    for (uint64_t i = 0; i < node_array.size; ++i) {
+      if (!node_array.data()[i].valid)
+        continue;
+      auto [begin, end] = get_valid_childs_range(parent, i);
+      sort_childs(parent, begin, end);
+    }
+    // Sorting moves children out of preorder
+    h.flags &= ~header::preorder_flag;
+  }
+  h.version = header::current_version;
+
+  if (!subtree_sizes_kept(parent)) {
+    count_subtree(parent, 0);
+    h.flags |= header::subtree_sizes_flag;
+  }
+}
+
+namespace {
+// Position of the key among the children in key order. Children of version
+// 1 images are in id order, their position is the number of smaller keys.
+uint32_t key_position(uint8_t* parent, uint64_t node_id,
+                      const dstree_::lookup_key& key, bool after_equal)
+{
+  const auto k = encode_key(parent, key);
+  auto [begin, end] = dstree_::get_valid_childs_range(parent, node_id);
+  auto before = [&](const dstree_::child& ch) {
+    const auto c = dstree_::compare_keys(child_key(parent, ch), k);
+    return c < 0 || (after_equal && c == 0);
+  };
+  if (!dstree_::childs_ordered(parent))
+    return static_cast<uint32_t>(std::count_if(begin, end, before));
+  return static_cast<uint32_t>(std::partition_point(begin, end, before) -
+                               begin);
+}
+}
+
+uint32_t dstree_::lower_bound(uint8_t* parent, uint64_t node_id,
+                              const lookup_key& key)
+{
+  return key_position(parent, node_id, key, false);
+}
+
+uint32_t dstree_::upper_bound(uint8_t* parent, uint64_t node_id,
+                              const lookup_key& key)
+{
+  return key_position(parent, node_id, key, true);
+}
+
+namespace {
+// Moves a child whose key has changed to its place in the parent's range
+void reposition_child(uint8_t* parent, uint64_t node_id)
+{
+  if (!dstree_::childs_ordered(parent))
+    return;
+  const auto parent_node = dstree_::get_node(parent, node_id)->parent_node;
+  auto [begin, end] = dstree_::get_valid_childs_range(parent, parent_node);
+  auto it = std::find_if(begin, end, [&](const dstree_::child& ch) {
+    return ch.node_id == node_id;
+  });
+  if (it == end)
+    return;
+  std::copy(it + 1, end, it);
+  insert_sorted(parent, begin, end - begin - 1, node_id,
+                static_cast<int>(end - begin));
+}
+}
+
+void dstree_::freeze(dstree_::buffer& parent, uint32_t min_fanout)
+{
+  std::vector<frozen_range> ranges;
+  std::vector<frozen_child> childs, sorted;
+
+  auto data = parent.data();
+  auto& node_array = get_node_array(data);
+  for (uint64_t i = 0; i < node_array.size; ++i) {
+    auto& n = node_array.data()[i];
+    if (!n.valid || n.child_nodes_size < std::max<uint32_t>(min_fanout, 1))
+      continue;
+
+    sorted.clear();
+    auto [begin, end] = get_valid_childs_range(data, i);
+    for (auto it = begin; it != end; ++it)
+      sorted.push_back({ node_array.data()[it->node_id].value, it->node_id });
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [&](const frozen_child& lhs, const frozen_child& rhs) {
+                       return compare_keys(to_lookup_key(data, lhs.value),
+                                           to_lookup_key(data, rhs.value)) <
+                         0;
+                     });
+
+    ranges.push_back({ i, childs.size(), sorted.size() });
+    childs.resize(childs.size() + sorted.size());
+    size_t pos = 0;
+    build_eytzinger(sorted, &childs[ranges.back().begin], pos, 1);
+  }
+
+  ensure_extra_tables(parent, 3);
+  get_frozen_ranges_array(parent.data()).resize(ranges.size(), parent);
+  std::copy(ranges.begin(), ranges.end(),
+            get_frozen_ranges_array(parent.data()).data());
+  get_frozen_childs_array(parent.data()).resize(childs.size(), parent);
+  std::copy(childs.begin(), childs.end(),
+            get_frozen_childs_array(parent.data()).data());
+}
+
+dstree_::tree_usage dstree_::get_usage(uint8_t* parent, uint64_t size)
+{
+  tree_usage res;
+  res.total_bytes = size;
+
+  auto& header = get_header(parent);
+  res.node_array_growth_factor = header.node_array_growth_factor;
+  res.childs_array_growth_factor = header.childs_array_growth_factor;
+
+  auto& node_array = get_node_array(parent);
+  res.nodes.capacity = node_array.size;
+  res.nodes.bytes = node_array.size * node::struct_size;
+  auto& string_array = get_string_array(parent);
+  res.strings.capacity = string_array.size;
+  res.strings.bytes = string_array.size;
+  for (uint64_t i = 0; i < node_array.size; ++i) {
+    auto& n = node_array.data()[i];
+    if (!n.valid)
+      continue;
+    ++res.nodes.used;
+    res.childs.used += n.child_nodes_size;
+    if (private_string(n.value))
+      res.strings.used +=
+        strlen(get_string(parent, n.value.data.string_index)) + 1;
+  }
+
+  auto& child_array = get_child_array(parent);
+  res.childs.capacity = child_array.size;
+  res.childs.bytes = child_array.size * child::struct_size;
+  for (uint64_t i = 0; i < child_array.size; ++i)
+    res.allocated_childs += child_array.data()[i].allocated;
+
+  const auto tables_end = reinterpret_cast<uint8_t*>(&string_array) -
+    parent + array<char>::struct_size + string_array.size;
+  res.extra_tables_bytes = size > tables_end ? size - tables_end : 0;
+  return res;
+}
+
+namespace {
+// Preorder of ids is the order walk visits nodes in only if ids of every
+// child range, which is sorted by key, ascend
+bool ids_follow_keys(const dstree_::child* begin, const dstree_::child* end)
+{
+  return std::is_sorted(
+    begin, end, [](const dstree_::child& lhs, const dstree_::child& rhs) {
+      return lhs.node_id < rhs.node_id;
+    });
+}
+
+// Nodes must already be stored in preorder without gaps
+void set_preorder_layout(uint8_t* parent)
+{
+  auto& node_array = get_node_array(parent);
+  auto nodes = node_array.data();
+  for (auto i = node_array.size; i-- > 0;) {
+    nodes[i].subtree_size += 1;
+    if (i > 0)
+      nodes[nodes[i].parent_node].subtree_size += nodes[i].subtree_size;
+  }
+  get_header(parent).flags |=
+    dstree_::header::preorder_flag | dstree_::header::subtree_sizes_flag;
+}
+}
+
+namespace {
+void set_dictionary_id(dstree_::buffer& parent, uint64_t id)
+{
+  ensure_extra_tables(parent, 5);
+  get_dictionary_array(parent.data()).resize(id ? 1 : 0, parent);
+  if (id)
+    get_dictionary_array(parent.data()).data()[0] = id;
+}
+}
+
+// Copies the subtree into a compact tree of the current version: ids are
+// renumbered in preorder, child ranges have no spare capacity and only
+// referenced strings are kept
+void dstree_::extract_subtree(uint8_t* parent, uint64_t node_id, buffer& out)
+{
+  auto& src_nodes = get_node_array(parent);
+  auto& src_childs = get_child_array(parent);
+
+  uint64_t n = 0, strings_size = 0;
+  std::vector<uint64_t> stack{ node_id };
+  while (!stack.empty()) {
+    auto& src = src_nodes.data()[stack.back()];
+    stack.pop_back();
+    ++n;
+    if (private_string(src.value))
+      strings_size +=
+        strlen(get_string(parent, src.value.data.string_index)) + 1;
+    for (uint32_t i = 0; i < src.child_nodes_size; ++i)
+      stack.push_back(src_childs.data()[src.child_nodes_begin + i].node_id);
+  }
+
+  out.assign(header::struct_size + 3 * array<int>::struct_size +
+               n * node::struct_size + (n - 1) * child::struct_size +
+               strings_size,
+             0);
+  auto& h = get_header(out.data());
+  h = header();
+  h.free_node_id = n;
+  h.node_array_growth_factor = get_header(parent).node_array_growth_factor;
+  h.childs_array_growth_factor = get_header(parent).childs_array_growth_factor;
+  get_node_array(out.data()).size = n;
+  get_child_array(out.data()).size = n - 1;
+  get_string_array(out.data()).size = strings_size;
+  auto nodes = get_node_array(out.data()).data();
+  auto childs = get_child_array(out.data()).data();
+  auto strings = get_string_array(out.data()).data();
+
+  struct pending
+  {
+    uint64_t src_id;
+    uint64_t parent_id;
+    uint64_t slot;
+  };
+  std::vector<pending> todo{ { node_id, node().parent_node, ~0ULL } };
+  std::vector<child> order;
+  const bool ordered = childs_ordered(parent);
+  uint64_t next_id = 0, next_child = 0, next_string = 0;
+  while (!todo.empty()) {
+    const auto p = todo.back();
+    todo.pop_back();
+    const auto id = next_id++;
+    if (p.slot != ~0ULL)
+      childs[p.slot].node_id = id;
+
+    auto& src = src_nodes.data()[p.src_id];
+    auto& dst = nodes[id];
+    dst = node();
+    dst.valid = 1;
+    dst.parent_node = p.parent_id;
+    dst.value = src.value;
+    if (private_string(src.value)) {
+      auto str = get_string(parent, src.value.data.string_index);
+      const auto str_size = strlen(str) + 1;
+      memcpy(strings + next_string, str, str_size);
+      dst.value.data.string_index = next_string;
+      next_string += str_size;
+    }
+
+    if (src.child_nodes_size) {
+      dst.child_nodes_begin = next_child;
+      dst.child_nodes_capacity = dst.child_nodes_size = src.child_nodes_size;
+      // Children of older versions are in id order
+      auto first = src_childs.data() + src.child_nodes_begin;
+      order.assign(first, first + src.child_nodes_size);
+      if (!ordered)
+        sort_childs(parent, order.data(), order.data() + order.size());
+      for (uint32_t i = src.child_nodes_size; i-- > 0;) {
+        childs[next_child + i].allocated = 1;
+        todo.push_back({ order[i].node_id, id, next_child + i });
+      }
+      next_child += src.child_nodes_size;
+    }
+  }
+  set_preorder_layout(out.data());
+  if (const auto id = dictionary_id(parent))
+    set_dictionary_id(out, id);
+}
+
+// Lays out nodes given in preorder, each parent preceding its children, as a
+// compact tree. Node ids are the preorder positions.
+void dstree_::build_tree(buffer& out, const node_value* values,
+                        const uint64_t* parents, uint64_t n,
+                        const uint8_t* strings, uint64_t strings_size)
+{
+  out.assign(header::struct_size + 3 * array<int>::struct_size +
+               n * node::struct_size + (n - 1) * child::struct_size +
+               strings_size,
+             0);
+  auto& h = get_header(out.data());
+  h = header();
+  h.free_node_id = n;
+  get_node_array(out.data()).size = n;
+  get_child_array(out.data()).size = n - 1;
+  get_string_array(out.data()).size = strings_size;
+  auto data = out.data();
+  auto nodes = get_node_array(data).data();
+  auto childs = get_child_array(data).data();
+  std::copy(strings, strings + strings_size,
+            reinterpret_cast<uint8_t*>(get_string_array(data).data()));
+
+  for (uint64_t i = 0; i < n; ++i) {
+    nodes[i] = node();
+    nodes[i].valid = 1;
+    nodes[i].value = values[i];
+    if (i > 0) {
+      nodes[i].parent_node = parents[i];
+      ++nodes[parents[i]].child_nodes_capacity;
+    }
+  }
+
+  uint64_t next_child = 0;
+  for (uint64_t i = 0; i < n; ++i) {
+    if (nodes[i].child_nodes_capacity) {
+      nodes[i].child_nodes_begin = next_child;
+      next_child += nodes[i].child_nodes_capacity;
+    }
+  }
+  for (uint64_t i = 1; i < n; ++i) {
+    auto& p = nodes[parents[i]];
+    auto& ch = childs[p.child_nodes_begin + p.child_nodes_size++];
+    ch.node_id = i;
+    ch.allocated = 1;
+  }
+
+  bool in_key_order = true;
+  for (uint64_t i = 0; i < n; ++i) {
+    auto [begin, end] = get_valid_childs_range(data, i);
+    sort_childs(data, begin, end);
+    in_key_order = in_key_order && ids_follow_keys(begin, end);
+  }
+  if (in_key_order) {
+    set_preorder_layout(data);
+    return;
+  }
+  // Children were added out of key order, ids are renumbered to follow keys
+  buffer sorted(out.get_allocator());
+  extract_subtree(data, 0, sorted);
+  out.swap(sorted);
+}
+
+void dstree_::parallel_for(size_t n, size_t threads,
+                           const std::function<void(size_t i)>& f)
+{
+  if (!threads)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min(threads, n);
+
+  std::atomic<size_t> next{ 0 };
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  auto work = [&] {
+    for (size_t i; (i = next++) < n;) {
+      try {
+        f(i);
+      } catch (...) {
+        std::lock_guard l(error_mutex);
+        if (!error)
+          error = std::current_exception();
+        next = n;
+      }
+    }
+  };
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < threads; ++i)
+    workers.emplace_back(work);
+  work();
+  for (auto& w : workers)
+    w.join();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+// Tables of the parts are placed one after another at offsets given by
+// prefix sums of their sizes, behind the root and its child range. Every
+// part is then copied and relocated like in graft by one of the threads,
+// no two of them write to the same bytes.
+void dstree_::join_trees(buffer& out, uint8_t* const* parts, size_t n,
+                         size_t threads)
+{
+  std::vector<uint64_t> node_offsets(n + 1, 1), child_offsets(n + 1, n),
+    string_offsets(n + 1, 0);
+  const auto dictionary = n ? dictionary_id(parts[0]) : 0;
+  bool preorder = true, sizes = true, ordered = true;
+  for (size_t i = 0; i < n; ++i) {
+    if (dictionary_id(parts[i]) != dictionary)
+      throw std::runtime_error("join needs all trees to use one dictionary");
+    // Free slots after the nodes of a part would be gaps in the result
+    preorder = preorder && preorder_layout(parts[i]) &&
+      get_node_array(parts[i]).size ==
+        get_node_array(parts[i]).data()[0].subtree_size;
+    sizes = sizes && subtree_sizes_kept(parts[i]);
+    ordered = ordered && childs_ordered(parts[i]);
+    node_offsets[i + 1] = node_offsets[i] + get_node_array(parts[i]).size;
+    child_offsets[i + 1] = child_offsets[i] + get_child_array(parts[i]).size;
+    string_offsets[i + 1] =
+      string_offsets[i] + get_string_array(parts[i]).size;
+  }
+
+  out.assign(header::struct_size + 3 * array<int>::struct_size +
+               node_offsets[n] * node::struct_size +
+               child_offsets[n] * child::struct_size + string_offsets[n],
+             0);
+  auto data = out.data();
+  auto& h = get_header(data);
+  h = header();
+  h.free_node_id = node_offsets[n];
+  get_node_array(data).size = node_offsets[n];
+  get_child_array(data).size = child_offsets[n];
+  get_string_array(data).size = string_offsets[n];
+  auto nodes = get_node_array(data).data();
+  auto childs = get_child_array(data).data();
+  auto strings = get_string_array(data).data();
+
+  nodes[0] = node();
+  nodes[0].valid = 1;
+  nodes[0].child_nodes_begin = 0;
+  nodes[0].child_nodes_capacity = nodes[0].child_nodes_size =
+    static_cast<uint32_t>(n);
+
+  parallel_for(n, threads, [&](size_t i) {
+    auto& src_nodes = get_node_array(parts[i]);
+    auto& src_childs = get_child_array(parts[i]);
+    auto& src_strings = get_string_array(parts[i]);
+
+    auto dst_nodes = nodes + node_offsets[i];
+    std::copy(src_nodes.data(), src_nodes.data() + src_nodes.size,
+              dst_nodes);
+    for (uint64_t j = 0; j < src_nodes.size; ++j) {
+      auto& nd = dst_nodes[j];
+      if (nd.child_nodes_capacity)
+        nd.child_nodes_begin += child_offsets[i];
+      if (nd.parent_node != node().parent_node)
+        nd.parent_node += node_offsets[i];
+      if (nd.valid && private_string(nd.value))
+        nd.value.data.string_index += string_offsets[i];
+    }
+    dst_nodes[0].parent_node = 0;
+
+    auto dst_childs = childs + child_offsets[i];
+    std::copy(src_childs.data(), src_childs.data() + src_childs.size,
+              dst_childs);
+    for (uint64_t j = 0; j < src_childs.size; ++j)
+      if (dst_childs[j].valid())
+        dst_childs[j].node_id += node_offsets[i];
+
+    std::copy(src_strings.data(), src_strings.data() + src_strings.size,
+              strings + string_offsets[i]);
+
+    childs[i].node_id = node_offsets[i];
+    childs[i].allocated = 1;
+  });
+
+  for (size_t i = 0; i < n; ++i) {
+    const auto free_id = get_header(parts[i]).free_node_id;
+    if (free_id < get_node_array(parts[i]).size)
+      h.free_node_id = std::min(h.free_node_id, node_offsets[i] + free_id);
+  }
+  // Keys of dictionary strings can only be compared once the id is set
+  if (dictionary)
+    set_dictionary_id(out, dictionary);
+  data = out.data();
+  nodes = get_node_array(data).data();
+  auto root_childs = get_valid_childs_range(data, 0);
+  sort_childs(data, root_childs.first, root_childs.second);
+  // Parts follow one another in the given order, not the order of their keys
+  if (preorder && ordered &&
+      ids_follow_keys(root_childs.first, root_childs.second))
+    get_header(data).flags |= header::preorder_flag;
+
+  // Parts of older versions are brought to the current layout in the copy
+  for (size_t i = 0; !ordered && i < n; ++i) {
+    if (childs_ordered(parts[i]))
+      continue;
+    for (auto id = node_offsets[i]; id < node_offsets[i + 1]; ++id) {
+      if (!nodes[id].valid)
+        continue;
+      auto [begin, end] = get_valid_childs_range(data, id);
+      sort_childs(data, begin, end);
+    }
+  }
+  // Parts keep their subtree sizes, so only the root needs one unless some
+  // part was saved before the sizes were kept
+  if (sizes) {
+    nodes[0].subtree_size = 1;
+    for (size_t i = 0; i < n; ++i)
+      nodes[0].subtree_size += nodes[node_offsets[i]].subtree_size;
+  } else {
+    count_subtree(data, 0);
+  }
+  get_header(data).flags |= header::subtree_sizes_flag;
+}
+
+// Appends all tables of another tree in one pass and relocates node ids,
+// child ranges and string offsets by the sizes of the tables they join
+uint64_t dstree_::graft(buffer& parent, uint64_t node_id, const uint8_t* src)
+{
+  get_header(parent.data()).flags &= ~header::preorder_flag;
+  auto src_data = const_cast<uint8_t*>(src);
+  auto& src_nodes = get_node_array(src_data);
+  auto& src_childs = get_child_array(src_data);
+  auto& src_strings = get_string_array(src_data);
+
+  const auto node_offset = get_node_array(parent.data()).size;
+  get_node_array(parent.data()).resize(node_offset + src_nodes.size, parent);
+  auto nodes = get_node_array(parent.data()).data();
+  std::copy(src_nodes.data(), src_nodes.data() + src_nodes.size,
+            nodes + node_offset);
+
+  const auto child_offset = get_child_array(parent.data()).size;
+  get_child_array(parent.data())
+    .resize(child_offset + src_childs.size, parent);
+  auto childs = get_child_array(parent.data()).data();
+  std::copy(src_childs.data(), src_childs.data() + src_childs.size,
+            childs + child_offset);
+
+  const auto string_offset = get_string_array(parent.data()).size;
+  get_string_array(parent.data())
+    .resize(string_offset + src_strings.size, parent);
+  std::copy(src_strings.data(), src_strings.data() + src_strings.size,
+            get_string_array(parent.data()).data() + string_offset);
+
+  nodes = get_node_array(parent.data()).data();
+  for (uint64_t i = node_offset; i < node_offset + src_nodes.size; ++i) {
+    auto& n = nodes[i];
+    if (n.child_nodes_capacity)
+      n.child_nodes_begin += child_offset;
+    if (n.parent_node != node().parent_node)
+      n.parent_node += node_offset;
+    if (n.valid && private_string(n.value))
+      n.value.data.string_index += string_offset;
+  }
+  childs = get_child_array(parent.data()).data();
+  for (uint64_t i = child_offset; i < child_offset + src_childs.size; ++i)
+    if (childs[i].valid())
+      childs[i].node_id += node_offset;
+
+  nodes[node_offset].parent_node = node_id;
+  resize_subtree_hashes(parent);
+  thaw(parent.data(), node_id);
+  mark_dirty(parent.data(), node_id);
+  resize_child_range_if_need(parent, node_id);
+  calculate_child_nodes_size(parent, node_id);
+  add_child(parent, node_id, node_offset);
+  const auto size = subtree_sizes_kept(src_data)
+    ? get_node(parent.data(), node_offset)->subtree_size
+    : count_subtree(parent.data(), node_offset);
+  add_subtree_size(parent.data(), node_id, size);
+
+  auto& header = get_header(parent.data());
+  auto& node_array = get_node_array(parent.data());
+  while (header.free_node_id < node_array.size &&
+         node_array.data()[header.free_node_id].valid)
+    ++header.free_node_id;
+
+  for (uint64_t i = node_offset; i < node_offset + src_nodes.size; ++i)
+    if (get_node_array(parent.data()).data()[i].valid)
+      global_index_add(parent, i);
+
+  return node_offset;
+}
+
+void dstree_::move_subtree(buffer& parent, uint64_t node_id,
+                           uint64_t new_parent)
+{
+  get_header(parent.data()).flags &= ~header::preorder_flag;
+  const auto n = get_node(parent.data(), node_id);
+  const auto size = static_cast<int64_t>(n->subtree_size);
+  add_subtree_size(parent.data(), n->parent_node, -size);
+  erase_node_from_parent_node(parent, node_id);
+  get_node(parent.data(), node_id)->parent_node = new_parent;
+  thaw(parent.data(), new_parent);
+  mark_dirty(parent.data(), new_parent);
+  resize_child_range_if_need(parent, new_parent);
+  calculate_child_nodes_size(parent, new_parent);
+  add_child(parent, new_parent, node_id);
+  add_subtree_size(parent.data(), new_parent, size);
+}
+// Subtree hashes are a table parallel to the node table. A zero hash marks a
+// node whose subtree changed since the hash was computed; ancestors of such
+// nodes are always zero too, so marking stops at the first dirty node.
+namespace {
+bool subtree_hashes_enabled(uint8_t* parent)
+{
+  return get_header(parent).extra_tables > 3 &&
+    get_subtree_hashes_array(parent).size > 0;
+}
+
+void resize_subtree_hashes(dstree_::buffer& parent)
+{
+  if (subtree_hashes_enabled(parent.data()))
+    get_subtree_hashes_array(parent.data())
+      .resize(get_node_array(parent.data()).size, parent);
+}
+
+void mark_dirty(uint8_t* parent, uint64_t node_id)
+{
+  if (!subtree_hashes_enabled(parent))
+    return;
+  auto hashes = get_subtree_hashes_array(parent).data();
+  auto nodes = get_node_array(parent).data();
+  for (auto id = node_id; id != dstree_::node().parent_node && hashes[id];
+       id = nodes[id].parent_node)
+    hashes[id] = 0;
+}
+
+// Children are combined with a sum, so the hash doesn't depend on the order
+// of node ids and trees built differently still hash equal
+uint64_t combine_hash(uint64_t key_hash, uint64_t childs_sum, uint32_t count)
+{
+  const auto h = mix(key_hash ^ mix(childs_sum + count));
+  return h ? h : 1;
+}
+}
+
+void dstree_::enable_subtree_hashes(buffer& parent)
+{
+  if (subtree_hashes_enabled(parent.data()))
+    return;
+  ensure_extra_tables(parent, 4);
+  get_subtree_hashes_array(parent.data())
+    .resize(get_node_array(parent.data()).size, parent);
+}
+
+bool dstree_::has_subtree_hashes(uint8_t* parent)
+{
+  return subtree_hashes_enabled(parent);
+}
+
+uint64_t dstree_::subtree_hash(uint8_t* parent, uint64_t node_id,
+                               bool writable, hash_cache& cache)
+{
+  const bool enabled = subtree_hashes_enabled(parent);
+  auto known = [&](uint64_t id) -> uint64_t {
+    if (enabled)
+      if (auto h = get_subtree_hashes_array(parent).data()[id])
+        return h;
+    auto it = cache.find(id);
+    return it == cache.end() ? 0 : it->second;
+  };
+
+  // Dirty nodes are collected top-down and hashed bottom-up, clean subtrees
+  // are never entered
+  std::vector<uint64_t> dirty, stack{ node_id };
+  while (!stack.empty()) {
+    const auto id = stack.back();
+    stack.pop_back();
+    if (known(id))
+      continue;
+    dirty.push_back(id);
+    auto [begin, end] = get_valid_childs_range(parent, id);
+    for (auto it = begin; it != end; ++it)
+      stack.push_back(it->node_id);
+  }
+
+  for (auto i = dirty.rbegin(); i != dirty.rend(); ++i) {
+    uint64_t sum = 0;
+    auto [begin, end] = get_valid_childs_range(parent, *i);
+    for (auto it = begin; it != end; ++it)
+      sum += mix(known(it->node_id));
+    const auto h = combine_hash(node_hash(parent, *i), sum,
+                                static_cast<uint32_t>(end - begin));
+    if (enabled && writable)
+      get_subtree_hashes_array(parent).data()[*i] = h;
+    else
+      cache[*i] = h;
+  }
+  return known(node_id);
+}
+
+namespace {
+struct diff_entry
+{
+  dstree_::lookup_key key;
+  uint64_t hash = 0;
+  uint64_t node_id = ~0;
+  bool matched = false;
+};
+
+std::vector<diff_entry> diff_entries(uint8_t* parent, uint64_t node_id,
+                                     bool writable, dstree_::hash_cache& cache)
+{
+  std::vector<diff_entry> res;
+  auto [begin, end] = dstree_::get_valid_childs_range(parent, node_id);
+  for (auto it = begin; it != end; ++it)
+    res.push_back(
+      { dstree_::to_lookup_key(parent,
+                               dstree_::get_node(parent, it->node_id)->value),
+        dstree_::subtree_hash(parent, it->node_id, writable, cache),
+        it->node_id });
+  std::sort(res.begin(), res.end(),
+            [](const diff_entry& lhs, const diff_entry& rhs) {
+              const auto c = dstree_::compare_keys(lhs.key, rhs.key);
+              return c ? c < 0 : lhs.hash < rhs.hash;
+            });
+  return res;
+}
+}
+
+// Children are paired by key and hash first, so identical subtrees are
+// skipped whatever their order, then the rest are paired by key alone
+void dstree_::diff(uint8_t* lhs, uint64_t lhs_id, bool lhs_writable,
+                   uint8_t* rhs, uint64_t rhs_id, bool rhs_writable,
+                   const diff_callback& callback)
+{
+  hash_cache lhs_cache, rhs_cache;
+  std::vector<std::pair<uint64_t, uint64_t>> stack{ { lhs_id, rhs_id } };
+  while (!stack.empty()) {
+    const auto [l, r] = stack.back();
+    stack.pop_back();
+    if (subtree_hash(lhs, l, lhs_writable, lhs_cache) ==
+        subtree_hash(rhs, r, rhs_writable, rhs_cache))
+      continue;
+
+    if (!value_equals(lhs, get_node(lhs, l)->value,
+                      to_lookup_key(rhs, get_node(rhs, r)->value)))
+      callback(diff_kind::value_changed, l, r);
+
+    auto a = diff_entries(lhs, l, lhs_writable, lhs_cache);
+    auto b = diff_entries(rhs, r, rhs_writable, rhs_cache);
+    for (size_t i = 0, j = 0; i < a.size() && j < b.size();) {
+      auto c = compare_keys(a[i].key, b[j].key);
+      if (!c)
+        c = (a[i].hash > b[j].hash) - (a[i].hash < b[j].hash);
+      if (c < 0)
+        ++i;
+      else if (c > 0)
+        ++j;
+      else
+        a[i++].matched = b[j++].matched = true;
+    }
+
+    a.erase(std::remove_if(a.begin(), a.end(),
+                           [](const diff_entry& e) { return e.matched; }),
+            a.end());
+    b.erase(std::remove_if(b.begin(), b.end(),
+                           [](const diff_entry& e) { return e.matched; }),
+            b.end());
+    size_t i = 0, j = 0;
+    while (i < a.size() || j < b.size()) {
+      const auto c = i == a.size() ? 1
+        : j == b.size()            ? -1
+                                   : compare_keys(a[i].key, b[j].key);
+      if (c < 0)
+        callback(diff_kind::removed, a[i++].node_id, ~0ULL);
+      else if (c > 0)
+        callback(diff_kind::added, ~0ULL, b[j++].node_id);
+      else
+        stack.push_back({ a[i++].node_id, b[j++].node_id });
+    }
+  }
+}
+
+bool dstree_::preorder_layout(uint8_t* parent)
+{
+  return get_header(parent).flags & header::preorder_flag;
+}
+
+// Rewrites the tree in preorder. Ids of all nodes but the root change, so
+// they get a generation newer than any handle could hold. The node table
+// keeps its slot count, free slots also get the new generation, so handles
+// to ids past the compacted nodes stay stale when the slots are reused.
+void dstree_::reorder(buffer& parent)
+{
+  auto data = parent.data();
+  uint32_t generation = 0;
+  auto& node_array = get_node_array(data);
+  for (uint64_t i = 0; i < node_array.size; ++i)
+    generation = std::max(generation, node_array.data()[i].generation);
+  const auto root_generation = node_array.data()[0].generation;
+  const auto slots = node_array.size;
+
+  uint64_t min_fanout = ~0ULL;
+  if (frozen_enabled(data)) {
+    auto& ranges = get_frozen_ranges_array(data);
+    for (uint64_t i = 0; i < ranges.size; ++i)
+      if (ranges.data()[i].size)
+        min_fanout = std::min(min_fanout, ranges.data()[i].size);
+  }
+  const bool global_index = global_index_enabled(data);
+  const bool hashes = subtree_hashes_enabled(data);
+
+  buffer out(parent.get_allocator());
+  extract_subtree(data, 0, out);
+  const auto n = get_node_array(out.data()).size;
+  get_node_array(out.data()).resize(slots, out);
+  auto out_nodes = get_node_array(out.data()).data();
+  for (uint64_t i = n; i < slots; ++i)
+    out_nodes[i] = node();
+  for (uint64_t i = 1; i < slots; ++i)
+    out_nodes[i].generation = generation + 1;
+  out_nodes[0].generation = root_generation;
+  parent.swap(out);
+
+  // Side tables are rebuilt for the new ids
+  if (global_index)
+    enable_global_index(parent);
+  if (min_fanout != ~0ULL)
+    freeze(parent, static_cast<uint32_t>(min_fanout));
+  if (hashes)
+    enable_subtree_hashes(parent);
+}
+
+void dstree_::walk(
+  uint8_t* parent, uint64_t node_id,
+  const std::function<bool(uint64_t node_id, size_t depth)>& callback)
+{
+  auto nodes = get_node_array(parent).data();
+
+  if (preorder_layout(parent)) {
+    // A linear sweep, skipping a subtree is a jump over its extent
+    std::vector<uint64_t> ends;
+    const auto end = node_id + nodes[node_id].subtree_size;
+    for (auto id = node_id; id < end;) {
+      while (!ends.empty() && id >= ends.back())
+        ends.pop_back();
+      const auto subtree_end = id + nodes[id].subtree_size;
+      if (callback(id, ends.size())) {
+        ends.push_back(subtree_end);
+        ++id;
+      } else {
+        id = subtree_end;
+      }
+    }
+    return;
+  }
+
+  std::vector<std::pair<uint64_t, size_t>> stack{ { node_id, 0 } };
+  while (!stack.empty()) {
+    const auto [id, depth] = stack.back();
+    stack.pop_back();
+    if (!callback(id, depth))
+      continue;
+    auto [begin, end] = get_valid_childs_range(parent, id);
+    for (auto it = end; it != begin;)
+      stack.push_back({ (--it)->node_id, depth + 1 });
+  }
+}
+
+// Read-only images saved before subtree sizes were kept are walked instead
+uint64_t dstree_::subtree_size(uint8_t* parent, uint64_t node_id)
+{
+  if (subtree_sizes_kept(parent))
+    return get_node(parent, node_id)->subtree_size;
+  uint64_t n = 0;
+  walk(parent, node_id, [&](uint64_t, size_t) {
+    ++n;
+    return true;
+  });
+  return n;
+}
+
+dstree_::tables dstree_::get_tables(uint8_t* parent)
+{
+  tables res;
+  res.nodes = get_node_array(parent).data();
+  res.childs = get_child_array(parent).data();
+  res.strings = get_string_array(parent).data();
+  if (auto d = tree_dictionary(parent)) {
+    res.dictionary_strings = d->strings.data();
+    res.dictionary_offsets = d->offsets.data();
+  }
+  return res;
+}
+
+uint64_t dstree_::dictionary_data::find(const char* str) const
+{
+  auto it = std::partition_point(
+    offsets.begin(), offsets.end(),
+    [&](uint64_t offset) { return strcmp(strings.data() + offset, str) < 0; });
+  if (it == offsets.end() || strcmp(strings.data() + *it, str))
+    return ~0ULL;
+  return it - offsets.begin();
+}
+
+uint64_t dstree_::dictionary_id(uint8_t* parent)
+{
+  if (get_header(parent).extra_tables < 5)
+    return 0;
+  auto& arr = get_dictionary_array(parent);
+  return arr.size ? arr.data()[0] : 0;
+}
+
+void dstree_::use_dictionary(buffer& parent, const dictionary_data* d)
+{
+  // Strings are re-encoded by content, so child order, the global index and
+  // subtree hashes stay valid
+  std::vector<std::pair<uint64_t, std::string>> strings;
+  auto& node_array = get_node_array(parent.data());
+  for (uint64_t i = 0; i < node_array.size; ++i) {
+    auto& n = node_array.data()[i];
+    if (n.valid && n.value.t == node_value::type::string_index)
+      strings.push_back(
+        { i, get_string(parent.data(), n.value.data.string_index) });
+  }
+
+  // The string table is rebuilt, so old copies don't stay behind
+  set_dictionary_id(parent, d ? d->id : 0);
+  get_string_array(parent.data()).resize(0, parent);
+  drop_free_strings(parent);
+  for (auto& [id, str] : strings) {
+    const auto pos = create_string(parent, str.c_str());
+    get_node_array(parent.data()).data()[id].value.data.string_index = pos;
+  }
+
+  if (frozen_enabled(parent.data())) {
+    auto nodes = get_node_array(parent.data()).data();
+    auto& frozen = get_frozen_childs_array(parent.data());
+    for (uint64_t i = 0; i < frozen.size; ++i)
+      frozen.data()[i].value = nodes[frozen.data()[i].node_id].value;
+  }
+}
+
+bool dstree_::check_level_types(uint8_t* parent, uint64_t node_id,
+                                const node_value::type* types, size_t n)
+{
+  bool res = true;
+  walk(parent, node_id, [&](uint64_t id, size_t depth) {
+    if (depth > 0 && get_node(parent, id)->value.t != types[depth - 1])
+      res = false;
+    return res && depth < n;
+  });
+  return res;
+}
+
+// Batches are applied in two phases. The first one validates the operations
+// and grows every table at once, so the second one, which changes the tree,
+// doesn't allocate and can't fail halfway.
+namespace {
+struct range_update
+{
+  std::vector<uint64_t> added;
+  uint32_t removed = 0;
+  bool move = false;
+  uint64_t new_begin = 0;
+  uint32_t new_capacity = 0;
+};
+
+void check_batch_target(uint8_t* parent, const dstree_::batch_op& op)
+{
+  auto n = dstree_::get_node(parent, op.node_id);
+  if (!n || !n->valid || n->generation != op.generation)
+    throw std::runtime_error("stale node handle");
+}
+
+std::vector<uint64_t> allocate_batch_nodes(dstree_::buffer& parent,
+                                           uint64_t count)
+{
+  std::vector<uint64_t> ids;
+  ids.reserve(count);
+  auto& node_array = get_node_array(parent.data());
+  for (auto i = get_header(parent.data()).free_node_id;
+       i < node_array.size && ids.size() < count; ++i)
+    if (!node_array.data()[i].valid)
+      ids.push_back(i);
+  if (ids.size() == count)
+    return ids;
+
+  const auto prev_size = node_array.size;
+  const auto missing = count - ids.size();
+  const auto new_size = std::max(
+    prev_size + missing,
+    (1 + prev_size) *
+      static_cast<uint64_t>(
+        pow(2, get_header(parent.data()).node_array_growth_factor)));
+  get_node_array(parent.data()).resize(new_size, parent);
+  for (auto i = prev_size; i < new_size; ++i)
+    get_node_array(parent.data()).data()[i] = dstree_::node();
+  resize_subtree_hashes(parent);
+  for (auto i = prev_size; ids.size() < count; ++i)
+    ids.push_back(i);
+  return ids;
+}
+
+void destroy_batch_node(dstree_::buffer& parent, uint64_t node_id)
+{
+  auto data = parent.data();
+  global_index_remove(data, node_id);
+  thaw(data, node_id);
+  auto& n = get_node_array(data).data()[node_id];
+  dstree_::free_child_range(parent, n.child_nodes_begin,
+                            n.child_nodes_capacity);
+  const auto value = n.value;
+  const auto generation = n.generation + 1;
+  n = dstree_::node();
+  n.generation = generation;
+  if (subtree_hashes_enabled(data))
+    get_subtree_hashes_array(data).data()[node_id] = 0;
+  auto& header = get_header(data);
+  if (node_id < header.free_node_id)
+    header.free_node_id = node_id;
+  if (private_string(value))
+    dstree_::destroy_string(parent, value.data.string_index);
+}
+}
+
+std::vector<uint64_t> dstree_::apply_batch(buffer& parent,
+                                           const std::vector<batch_op>& ops,
+                                           const std::vector<char>& strings)
+{
+  const auto none = node().parent_node;
+
+  // Validation, nothing is changed until all operations are known to apply
+  std::unordered_set<uint64_t> erased;
+  uint64_t inserts = 0;
+  for (auto& op : ops) {
+    if (op.t == batch_op::type::insert)
+      ++inserts;
+    if (op.pending)
+      continue;
+    check_batch_target(parent.data(), op);
+    if (op.t == batch_op::type::erase) {
+      if (get_node(parent.data(), op.node_id)->parent_node == none)
+        throw std::runtime_error("batch can't erase the root node");
+      erased.insert(op.node_id);
+    }
+  }
+
+  auto erased_ancestor = [&](uint64_t id, bool include_self) {
+    auto nodes = get_node_array(parent.data()).data();
+    for (auto i = include_self ? id : nodes[id].parent_node; i != none;
+         i = nodes[i].parent_node)
+      if (erased.count(i))
+        return true;
+    return false;
+  };
+
+  std::unordered_set<uint64_t> top_erased;
+  for (auto id : erased)
+    if (!erased_ancestor(id, false))
+      top_erased.insert(id);
+  for (auto& op : ops)
+    if (!op.pending && op.t != batch_op::type::erase &&
+        erased_ancestor(op.node_id, true))
+      throw std::runtime_error("batch changes a node it erases");
+
+  const std::vector<uint64_t> erased_roots(top_erased.begin(),
+                                           top_erased.end());
+  std::vector<uint64_t> doomed;
+  for (auto id : top_erased) {
+    std::vector<uint64_t> stack{ id };
+    while (!stack.empty()) {
+      const auto i = stack.back();
+      stack.pop_back();
+      doomed.push_back(i);
+      auto [begin, end] = get_valid_childs_range(parent.data(), i);
+      for (auto it = begin; it != end; ++it)
+        stack.push_back(it->node_id);
+    }
+  }
+
+  // Growth of the node, string, global index and child tables
+  const auto ids = allocate_batch_nodes(parent, inserts);
+
+  const auto string_offset = get_string_array(parent.data()).size;
+  get_string_array(parent.data())
+    .resize(string_offset + strings.size(), parent);
+  std::copy(strings.begin(), strings.end(),
+            get_string_array(parent.data()).data() + string_offset);
+
+  if (global_index_enabled(parent.data())) {
+    auto& arr = get_global_index_array(parent.data());
+    auto capacity = arr.size - 1;
+    while ((arr.data()[0] + inserts + 1) * 2 > capacity)
+      capacity *= 2;
+    if (capacity != arr.size - 1)
+      global_index_rehash(parent, capacity);
+  }
+
+  std::unordered_map<uint64_t, range_update> updates;
+  std::vector<uint64_t> parent_ids;
+  for (size_t i = 0, insert = 0; i < ops.size(); ++i) {
+    auto& op = ops[i];
+    const auto target = op.pending ? ids[op.node_id] : op.node_id;
+    if (op.t == batch_op::type::insert)
+      updates[target].added.push_back(ids[insert++]);
+    else if (op.t == batch_op::type::erase && top_erased.erase(target))
+      updates[get_node(parent.data(), target)->parent_node].removed++;
+    else if (op.t == batch_op::type::set_value &&
+             get_node(parent.data(), target)->parent_node != none)
+      updates[get_node(parent.data(), target)->parent_node];
+    if (op.t == batch_op::type::insert)
+      parent_ids.push_back(target);
+  }
+
+  uint64_t extra_childs = 0, max_childs = 0;
+  const auto growth_factor =
+    get_header(parent.data()).childs_array_growth_factor;
+  for (auto& [id, u] : updates) {
+    auto n = get_node(parent.data(), id);
+    const bool created = !n->valid;
+    const uint32_t count = (created ? 0 : n->child_nodes_size) - u.removed +
+      static_cast<uint32_t>(u.added.size());
+    max_childs = std::max<uint64_t>(max_childs, count);
+    if (count <= (created ? 0 : n->child_nodes_capacity))
+      continue;
+    u.move = true;
+    u.new_capacity = created ? 0 : n->child_nodes_capacity;
+    while (u.new_capacity < count)
+      u.new_capacity = created
+        ? count
+        : (1 + u.new_capacity) *
+          static_cast<uint32_t>(pow(2, growth_factor));
+    u.new_begin = get_child_array(parent.data()).size + extra_childs;
+    extra_childs += u.new_capacity;
+  }
+  if (extra_childs) {
+    const auto prev_size = get_child_array(parent.data()).size;
+    get_child_array(parent.data()).resize(prev_size + extra_childs, parent);
+    auto& arr = get_child_array(parent.data());
+    for (auto j = prev_size; j < arr.size; ++j) {
+      arr.data()[j] = child();
+      arr.data()[j].allocated = 1;
+    }
+  }
+  std::vector<child> scratch;
+  scratch.reserve(max_childs);
+
+  // Room for the strings of erased nodes and replaced values
+  uint64_t set_values = 0, released_strings = 0;
+  for (auto& op : ops)
+    set_values += op.t == batch_op::type::set_value;
+  for (auto id : doomed)
+    released_strings += private_string(get_node(parent.data(), id)->value);
+  std::vector<uint64_t> released;
+  released.reserve(set_values);
+  reserve_released_strings(parent, set_values + released_strings);
+
+  // Application
+  auto data = parent.data();
+  auto nodes = get_node_array(data).data();
+  for (size_t i = 0; i < ids.size(); ++i) {
+    auto& n = nodes[ids[i]];
+    const auto generation = n.generation;
+    n = node();
+    n.generation = generation;
+    n.valid = 1;
+    n.parent_node = parent_ids[i];
+    n.subtree_size = 1;
+  }
+  // New nodes are linked to their parents already, so inserts below other
+  // inserts count towards them as well
+  for (auto id : erased_roots)
+    add_subtree_size(data, nodes[id].parent_node,
+                     -static_cast<int64_t>(nodes[id].subtree_size));
+  for (auto id : parent_ids)
+    add_subtree_size(data, id, 1);
+  for (size_t i = 0, insert = 0; i < ops.size(); ++i) {
+    auto& op = ops[i];
+    auto value = op.value;
+    if (private_string(value))
+      value.data.string_index += string_offset;
+    if (op.t == batch_op::type::insert) {
+      nodes[ids[insert]].value = value;
+      global_index_add(parent, ids[insert++]);
+    } else if (op.t == batch_op::type::set_value) {
+      global_index_remove(data, op.node_id);
+      if (private_string(nodes[op.node_id].value))
+        released.push_back(nodes[op.node_id].value.data.string_index);
+      nodes[op.node_id].value = value;
+      global_index_place(data, op.node_id);
+      mark_dirty(data, op.node_id);
+    }
+  }
+
+  auto& h = get_header(data);
+  h.flags &= ~header::preorder_flag;
+  while (h.free_node_id < get_node_array(data).size &&
+         nodes[h.free_node_id].valid)
+    ++h.free_node_id;
+  for (auto id : doomed)
+    destroy_batch_node(parent, id);
+  for (auto pos : released)
+    destroy_string(parent, pos);
+  data = parent.data();
+  nodes = get_node_array(data).data();
+
+  auto childs = get_child_array(data).data();
+  for (auto& [id, u] : updates) {
+    auto& n = nodes[id];
+    scratch.clear();
+    for (uint32_t i = 0; i < n.child_nodes_size; ++i) {
+      auto& ch = childs[n.child_nodes_begin + i];
+      if (nodes[ch.node_id].valid)
+        scratch.push_back(ch);
+    }
+    for (auto child_id : u.added) {
+      child ch;
+      ch.node_id = child_id;
+      ch.allocated = 1;
+      scratch.push_back(ch);
+    }
+    sort_childs(data, scratch.data(), scratch.data() + scratch.size());
+
+    if (u.move) {
+      free_child_range(parent, n.child_nodes_begin, n.child_nodes_capacity);
+      n.child_nodes_begin = u.new_begin;
+      n.child_nodes_capacity = u.new_capacity;
+    }
+    for (uint32_t i = 0; i < n.child_nodes_capacity; ++i) {
+      auto& ch = childs[n.child_nodes_begin + i];
+      if (i < scratch.size()) {
+        ch = scratch[i];
+      } else {
+        ch = child();
+        ch.allocated = 1;
+      }
+    }
+    n.child_nodes_size = static_cast<uint32_t>(scratch.size());
+    thaw(data, id);
+    mark_dirty(data, id);
+  }
+  return ids;
+}
+
+// Node slots are kept with their generations, so handles to the removed
+// nodes stay stale when the slots are reused
+void dstree_::clear(buffer& parent)
+{
+  auto data = parent.data();
+  const bool global_index = global_index_enabled(data);
+  const bool hashes = subtree_hashes_enabled(data);
+  const auto dictionary = dictionary_id(data);
+
+  auto& node_array = get_node_array(data);
+  for (uint64_t i = 0; i < node_array.size; ++i) {
+    auto& n = node_array.data()[i];
+    const auto generation = n.generation + (i && n.valid);
+    n = node();
+    n.generation = generation;
+  }
+  node_array.data()[0].valid = 1;
+  node_array.data()[0].subtree_size = 1;
+
+  const auto tables_end = reinterpret_cast<uint8_t*>(&node_array) - data +
+    array<node>::struct_size + node_array.size * node::struct_size;
+  parent.resize(tables_end);
+  parent.resize(tables_end + 2 * array<int>::struct_size, 0);
+  auto& h = get_header(parent.data());
+  h.version = header::current_version;
+  h.free_node_id = 1;
+  h.extra_tables = 0;
+  h.flags = header::subtree_sizes_flag;
+
+  if (global_index)
+    enable_global_index(parent);
+  if (hashes)
+    enable_subtree_hashes(parent);
+  if (dictionary)
+    set_dictionary_id(parent, dictionary);
+}
+
+// Node ids stay, so do handles, child ranges and strings are repacked
+void dstree_::shrink_to_fit(buffer& parent)
+{
+  auto data = parent.data();
+  auto& node_array = get_node_array(data);
+  auto nodes = node_array.data();
+  auto childs = get_child_array(data).data();
+
+  std::vector<child> new_childs;
+  std::vector<char> new_strings;
+  for (uint64_t i = 0; i < node_array.size; ++i) {
+    auto& n = nodes[i];
+    if (!n.valid)
+      continue;
+    if (private_string(n.value)) {
+      auto str = get_string(data, n.value.data.string_index);
+      n.value.data.string_index = new_strings.size();
+      new_strings.insert(new_strings.end(), str, str + strlen(str) + 1);
+    }
+    const auto begin = new_childs.size();
+    for (uint32_t k = 0; k < n.child_nodes_size; ++k) {
+      new_childs.push_back(childs[n.child_nodes_begin + k]);
+      new_childs.back().allocated = 1;
+    }
+    n.child_nodes_begin =
+      n.child_nodes_size ? begin : node().child_nodes_begin;
+    n.child_nodes_capacity = n.child_nodes_size;
+  }
+
+  if (frozen_enabled(data)) {
+    auto& frozen = get_frozen_childs_array(data);
+    for (uint64_t i = 0; i < frozen.size; ++i)
+      frozen.data()[i].value = nodes[frozen.data()[i].node_id].value;
+  }
+
+  get_child_array(parent.data()).resize(new_childs.size(), parent);
+  std::copy(new_childs.begin(), new_childs.end(),
+            get_child_array(parent.data()).data());
+  get_string_array(parent.data()).resize(new_strings.size(), parent);
+  std::copy(new_strings.begin(), new_strings.end(),
+            get_string_array(parent.data()).data());
+  drop_free_strings(parent);
+  parent.shrink_to_fit();
+}
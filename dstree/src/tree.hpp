@@ -1,98 +1,163 @@
+#pragma once
 #include <cstdint>
+#include <dstree/format.hpp>
+#include <functional>
+#include <memory_resource>
+#include <unordered_map>
 #include <vector>
 
 namespace dstree_ {
-#pragma pack(push, 1)
-class header
+// Sorted strings shared by many trees, registered by id while alive
+struct dictionary_data
 {
-public:
-  static constexpr size_t struct_size = 32;
+  uint64_t id = 0;
+  std::vector<char> strings;
+  std::vector<uint64_t> offsets;
 
-  uint32_t version = 1;
-  uint64_t free_node_id = 0;
-  uint32_t node_array_growth_factor = 1;
-  uint32_t childs_array_growth_factor = 1;
-  uint32_t reserved[3] = { 0, 0, 0 };
+  const char* get(uint64_t i) const { return strings.data() + offsets[i]; }
+  // Index of the string, ~0 if there is none
+  uint64_t find(const char* str) const;
 };
-static_assert(sizeof(header) == header::struct_size);
-#pragma pack(pop)
 
-#pragma pack(push, 1)
-struct node_value
+struct lookup_key
 {
-  static constexpr size_t struct_size = 9;
-
-  node_value() noexcept;
-  node_value(int64_t value, std::vector<uint8_t>* parent = nullptr) noexcept;
-  node_value(double value, std::vector<uint8_t>* parent = nullptr) noexcept;
-  node_value(const char* value, std::vector<uint8_t>* parent) noexcept;
-
-  enum class type : uint8_t
-  {
-    integer,
-    floating_point,
-    string_index
-  };
-
-  type t = type::integer;
+  node_value::type t = node_value::type::integer;
   union
   {
     int64_t integer = 0;
     double floating_point;
-    uint64_t string_index;
+    const char* string;
   } data;
+  // Set for strings of a dictionary, keys of one dictionary compare by id
+  const dictionary_data* dictionary = nullptr;
+  uint64_t string_id = 0;
 };
-static_assert(sizeof(node_value) == node_value::struct_size);
-#pragma pack(pop)
 
-#pragma pack(push, 1)
-struct node
+struct table_usage
 {
-  static constexpr size_t struct_size = 48;
-
-  uint64_t child_nodes_begin = ~0;
-  uint32_t child_nodes_capacity = 0;
-  uint32_t child_nodes_size = 0;
-  node_value value;
-  uint8_t valid = 0;
-  uint64_t parent_node = ~0;
-  uint8_t reserved[14] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+  uint64_t capacity = 0;
+  uint64_t used = 0;
+  uint64_t bytes = 0;
 };
-static_assert(sizeof(node) == node::struct_size);
-#pragma pack(pop)
 
-#pragma pack(push, 1)
-struct child
+struct tree_usage
 {
-  static constexpr size_t struct_size = 12;
-
-  uint64_t node_id = ~0;
-  uint8_t allocated = 0;
-  uint8_t reserved[3] = { 0, 0, 0 };
+  uint64_t total_bytes = 0;
+  table_usage nodes;
+  table_usage childs;
+  uint64_t allocated_childs = 0;
+  table_usage strings;
+  uint64_t extra_tables_bytes = 0;
+  uint32_t node_array_growth_factor = 0;
+  uint32_t childs_array_growth_factor = 0;
+};
 
-  bool valid() const { return node_id != child().node_id; }
+enum class diff_kind
+{
+  added,
+  removed,
+  value_changed
+};
+using diff_callback =
+  std::function<void(diff_kind kind, uint64_t lhs_id, uint64_t rhs_id)>;
+using hash_cache = std::unordered_map<uint64_t, uint64_t>;
 
-  friend bool operator<(const child& lhs, const child& rhs)
+struct batch_op
+{
+  enum class type : uint8_t
   {
-    return lhs.node_id < rhs.node_id;
-  }
+    insert,
+    erase,
+    set_value
+  };
+
+  type t = type::insert;
+  // Target node, parent node for inserts
+  uint64_t node_id = ~0;
+  uint32_t generation = 0;
+  // node_id is the index of an earlier insert of the batch
+  bool pending = false;
+  // String values are offsets in the strings of the batch
+  node_value value;
 };
-static_assert(sizeof(child) == child::struct_size);
-#pragma pack(pop)
 
-void init_empty_tree(std::vector<uint8_t>& parent);
+void init_empty_tree(buffer& parent);
 node* get_node(uint8_t* parent, uint64_t node_id);
-uint64_t create_node(std::vector<uint8_t>& parent);
-void destroy_node(std::vector<uint8_t>& parent, uint64_t node_id);
-uint64_t insert(std::vector<uint8_t>& parent, uint64_t node_id,
-                const node_value& value);
-uint64_t allocate_child_range(std::vector<uint8_t>& parent, uint32_t size);
-void free_child_range(std::vector<uint8_t>& parent, uint64_t begin,
-                      uint32_t size);
+uint64_t create_node(buffer& parent);
+void destroy_node(buffer& parent, uint64_t node_id);
+uint64_t insert(buffer& parent, uint64_t node_id, const node_value& value);
+uint64_t allocate_child_range(buffer& parent, uint32_t size);
+void free_child_range(buffer& parent, uint64_t begin, uint32_t size);
 std::pair<child*, child*> get_valid_childs_range(uint8_t* parent,
                                                  uint64_t node_id);
-void set_value(uint8_t* parent, uint64_t node_id, node_value new_value);
-uint64_t create_string(std::vector<uint8_t>& parent, const char* str);
-void destroy_string(std::vector<uint8_t>& parent, uint64_t pos);
+void set_value(buffer& parent, uint64_t node_id, node_value new_value);
+uint64_t create_string(buffer& parent, const char* str);
+void destroy_string(buffer& parent, uint64_t pos);
 const char* get_string(uint8_t* parent, uint64_t pos);
+lookup_key to_lookup_key(uint8_t* parent, const node_value& value);
+bool value_equals(uint8_t* parent, const node_value& value,
+                  const lookup_key& k);
+uint64_t key_hash(const lookup_key& k);
+void enable_global_index(buffer& parent);
+bool has_global_index(uint8_t* parent);
+std::vector<uint64_t> find_all_global(uint8_t* parent, const lookup_key& k);
+int compare_keys(const lookup_key& lhs, const lookup_key& rhs);
+uint64_t find_child(uint8_t* parent, uint64_t node_id, const lookup_key& k);
+void find_children(uint8_t* parent, const uint64_t* node_ids,
+                   const lookup_key* keys, size_t n, uint64_t* out);
+bool childs_ordered(uint8_t* parent);
+// Equal keys keep their order
+void sort_childs(uint8_t* parent, child* begin, child* end);
+// Throws unless the image is a tree of a supported version whose tables fit
+// in its length and whose ids, child ranges and string offsets stay inside
+// them
+void check_image(const uint8_t* data, size_t length);
+// Brings an image of an older version to the current layout in place
+void upgrade(uint8_t* parent);
+uint32_t lower_bound(uint8_t* parent, uint64_t node_id, const lookup_key& k);
+uint32_t upper_bound(uint8_t* parent, uint64_t node_id, const lookup_key& k);
+void freeze(buffer& parent, uint32_t min_fanout);
+tree_usage get_usage(uint8_t* parent, uint64_t size);
+void extract_subtree(uint8_t* parent, uint64_t node_id, buffer& out);
+void build_tree(buffer& out, const node_value* values, const uint64_t* parents,
+                uint64_t n, const uint8_t* strings, uint64_t strings_size);
+// Calls f(0) ... f(n - 1) on up to the given number of threads, zero means
+// one per core. The first exception thrown by f is rethrown after all
+// threads finish.
+void parallel_for(size_t n, size_t threads,
+                  const std::function<void(size_t i)>& f);
+// Makes the trees children of a new root with a default value
+void join_trees(buffer& out, uint8_t* const* parts, size_t n, size_t threads);
+uint64_t graft(buffer& parent, uint64_t node_id, const uint8_t* src);
+void move_subtree(buffer& parent, uint64_t node_id, uint64_t new_parent);
+std::vector<uint64_t> apply_batch(buffer& parent,
+                                  const std::vector<batch_op>& ops,
+                                  const std::vector<char>& strings);
+bool preorder_layout(uint8_t* parent);
+void reorder(buffer& parent);
+void walk(uint8_t* parent, uint64_t node_id,
+          const std::function<bool(uint64_t node_id, size_t depth)>& callback);
+// Number of nodes in the subtree including the node itself
+uint64_t subtree_size(uint8_t* parent, uint64_t node_id);
+tables get_tables(uint8_t* parent);
+// Loaded dictionary with the id, null if there is none
+const dictionary_data* find_dictionary(uint64_t id);
+// Zero for trees without a dictionary
+uint64_t dictionary_id(uint8_t* parent);
+// Strings found in the dictionary are stored as its ids from now on, null
+// stores every string in the tree again
+void use_dictionary(buffer& parent, const dictionary_data* d);
+// Leaves the root alone with a default value, keeping buffer capacity and
+// enabled side tables
+void clear(buffer& parent);
+void shrink_to_fit(buffer& parent);
+// Whether keys at depth d below the node, 0 < d <= n, have type types[d - 1]
+bool check_level_types(uint8_t* parent, uint64_t node_id,
+                       const node_value::type* types, size_t n);
+void enable_subtree_hashes(buffer& parent);
+bool has_subtree_hashes(uint8_t* parent);
+uint64_t subtree_hash(uint8_t* parent, uint64_t node_id, bool writable,
+                      hash_cache& cache);
+void diff(uint8_t* lhs, uint64_t lhs_id, bool lhs_writable, uint8_t* rhs,
+          uint64_t rhs_id, bool rhs_writable, const diff_callback& callback);
 }
\ No newline at end of file
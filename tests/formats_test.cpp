@@ -0,0 +1,66 @@
+#include "formats.hpp"
+#include <catch.hpp>
+#include <sstream>
+
+namespace {
+std::filesystem::path write_temp(const std::string& name,
+                                 const std::string& content)
+{
+  auto p = std::filesystem::temp_directory_path() / name;
+  std::ofstream(p, std::ios::binary) << content;
+  return p;
+}
+
+std::string json_round_trip(const std::string& json)
+{
+  reader in(write_temp("dstree_formats_test.json", json));
+  auto t = import_json(in);
+  std::ostringstream os;
+  {
+    writer out(os);
+    export_json(t, out);
+  }
+  return os.str();
+}
+
+std::string msgpack_round_trip(const std::string& json)
+{
+  reader json_in(write_temp("dstree_formats_test.json", json));
+  auto t = import_json(json_in);
+  std::ostringstream packed;
+  {
+    writer out(packed);
+    export_msgpack(t, out);
+  }
+  reader in(write_temp("dstree_formats_test.msgpack", packed.str()));
+  auto back = import_msgpack(in);
+  std::ostringstream os;
+  {
+    writer out(os);
+    export_json(back, out);
+  }
+  return os.str();
+}
+}
+
+TEST_CASE("json and msgpack round trips", "[formats]")
+{
+  for (std::string doc :
+       { R"({"a":{"x":null}})", "[null]", R"({"d":true})", "[false]",
+         R"([[null],{"":null},{"1":2}])", "[{}]", R"({"e":[]})", "null",
+         "7", R"("s")", R"({"n":[null,[null,{"y":[{}]}]],"s":"t"})",
+         R"([1.5,-2,"x",true])" }) {
+    REQUIRE(json_round_trip(doc) == doc + "\n");
+    REQUIRE(msgpack_round_trip(doc) == doc + "\n");
+  }
+
+  // Nodes without children, as in trees built by hand, are nulls
+  dstree t(0LL);
+  t.insert("a");
+  std::ostringstream os;
+  {
+    writer out(os);
+    export_json(t, out);
+  }
+  REQUIRE(os.str() == "{\"a\":null}\n");
+}
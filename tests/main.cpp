@@ -1,7 +1,12 @@
 #define CATCH_CONFIG_MAIN
 #include <catch.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <dstree/dstree.hpp>
+#include <dstree/typed_view.hpp>
+#include <filesystem>
+#include <fstream>
 
 TEST_CASE("serialization", "[dstree]")
 {
@@ -30,4 +35,1014 @@ TEST_CASE("serialization", "[dstree]")
           std::string("hello"));
   REQUIRE(std::get<double>(t2.find(2.0).find(3.0).data()) == 3.0);
   REQUIRE(std::get<int64_t>(t2.find(2.0).find(3.0).find(4LL).data()) == 4LL);
-}
\ No newline at end of file
+}
+
+TEST_CASE("global index", "[dstree]")
+{
+  dstree t;
+  t.enable_global_index();
+
+  auto a = t.insert("tag");
+  a.insert(1LL);
+  a.insert("tag");
+  auto b = t.insert(2.0);
+  b.insert("tag");
+  b.insert("other");
+
+  REQUIRE(t.find_all_global("tag").size() == 3);
+  REQUIRE(t.find_all_global(1LL).size() == 1);
+  REQUIRE(t.find_all_global(1.0).empty());
+
+  t.find(2.0).find("tag").set_data(3LL);
+  REQUIRE(t.find_all_global("tag").size() == 2);
+  REQUIRE(t.find_all_global(3LL).size() == 1);
+
+  t.erase(t.find("tag"));
+  REQUIRE(t.find_all_global("tag").empty());
+  REQUIRE(t.find_all_global(1LL).empty());
+
+  for (int64_t i = 0; i < 100; ++i)
+    t.find(2.0).insert(i % 10);
+  REQUIRE(t.find_all_global(7LL).size() == 10);
+  REQUIRE(std::get<int64_t>(t.find_all_global(7LL)[0].data()) == 7);
+
+  auto n = t.serialize(nullptr, 0);
+  std::vector<uint8_t> vec(n);
+  t.serialize(vec.data(), vec.size());
+  auto t2 = dstree::deserialize(vec.data(), vec.size(),
+                                dstree::owning_mode::non_owning);
+  REQUIRE(t2.find_all_global(3LL).size() == 11);
+  REQUIRE(t2.find_all_global("other").size() == 1);
+}
+
+
+TEST_CASE("freeze", "[dstree]")
+{
+  dstree t;
+  for (int64_t i = 0; i < 1000; ++i)
+    t.insert(i * 7 % 1000);
+  t.insert("str");
+  t.insert(0.5);
+  t.insert(-3LL).insert(33LL);
+  t.find(5LL).insert(1LL);
+  t.freeze();
+
+  for (int64_t i = 0; i < 1000; ++i)
+    REQUIRE(std::get<int64_t>(t.find(i).data()) == i);
+  REQUIRE(std::get<int64_t>(t.find(-3LL).find(33LL).data()) == 33);
+  REQUIRE(std::get<double>(t.find(0.5).data()) == 0.5);
+  REQUIRE(std::get<const char*>(t.find("str").data()) == std::string("str"));
+  REQUIRE_THROWS(t.find(1000LL));
+  REQUIRE_THROWS(t.find(3.0));
+
+  auto n = t.serialize(nullptr, 0);
+  std::vector<uint8_t> vec(n);
+  t.serialize(vec.data(), vec.size());
+  auto t2 = dstree::deserialize(vec.data(), vec.size(),
+                                dstree::owning_mode::non_owning);
+  REQUIRE(std::get<int64_t>(t2.find(5LL).find(1LL).data()) == 1);
+  REQUIRE(std::get<int64_t>(t2.find(999LL).data()) == 999);
+
+  t.insert(1000LL);
+  t.erase(t.find(10LL));
+  REQUIRE(std::get<int64_t>(t.find(1000LL).data()) == 1000);
+  REQUIRE_THROWS(t.find(10LL));
+}
+
+
+namespace {
+class counting_resource : public std::pmr::memory_resource
+{
+public:
+  size_t allocated = 0;
+  size_t in_use = 0;
+
+private:
+  void* do_allocate(size_t bytes, size_t alignment) override
+  {
+    allocated += bytes;
+    in_use += bytes;
+    return std::pmr::new_delete_resource()->allocate(bytes, alignment);
+  }
+
+  void do_deallocate(void* p, size_t bytes, size_t alignment) override
+  {
+    in_use -= bytes;
+    std::pmr::new_delete_resource()->deallocate(p, bytes, alignment);
+  }
+
+  bool do_is_equal(const memory_resource& other) const noexcept override
+  {
+    return this == &other;
+  }
+};
+}
+
+TEST_CASE("memory resource", "[dstree]")
+{
+  counting_resource resource;
+  {
+    dstree t(100LL, &resource);
+    t.insert("hello").insert(1.5);
+    REQUIRE(resource.allocated > 0);
+
+    auto allocated = resource.allocated;
+    REQUIRE(std::get<double>(t.find("hello").find(1.5).data()) == 1.5);
+    REQUIRE(resource.allocated > allocated);
+
+    std::vector<uint8_t> vec(t.serialize(nullptr, 0));
+    t.serialize(vec.data(), vec.size());
+
+    counting_resource other;
+    auto t2 = dstree::deserialize(vec.data(), vec.size(),
+                                  dstree::owning_mode::owning, &other);
+    REQUIRE(other.in_use >= vec.size());
+    REQUIRE(std::get<int64_t>(t2.data()) == 100LL);
+  }
+  REQUIRE(resource.in_use == 0);
+}
+
+
+TEST_CASE("placement resource", "[dstree]")
+{
+  dstree::placement_options options;
+  options.min_mapping_size = 4096;
+  options.numa = dstree::numa_policy::interleave;
+  options.numa_nodes = 1;
+  auto resource = dstree::make_placement_resource(options);
+
+  dstree t(0LL, resource.get());
+  for (int64_t i = 0; i < 1000; ++i)
+    t.insert(i).insert("value");
+
+  options.huge_pages = dstree::huge_page_mode::none;
+  options.numa = dstree::numa_policy::bind;
+  auto replica_resource = dstree::make_placement_resource(options);
+  auto replica = t.replicate(replica_resource.get());
+
+  for (int64_t i = 0; i < 1000; i += 99)
+    REQUIRE(std::get<const char*>(replica.find(i).find("value").data()) ==
+            std::string("value"));
+  REQUIRE(replica.serialize(nullptr, 0) == t.serialize(nullptr, 0));
+}
+
+
+TEST_CASE("handles", "[dstree]")
+{
+  auto child = [] {
+    dstree t(1LL);
+    return t.insert(2LL);
+  }();
+  REQUIRE(std::get<int64_t>(child.data()) == 2);
+
+  dstree t;
+  auto a = t.insert(5LL);
+  auto copy = a;
+  a.insert(6LL);
+  REQUIRE(copy.size() == 1);
+
+  dstree assigned;
+  assigned = copy;
+  REQUIRE(std::get<int64_t>(assigned.find(6LL).data()) == 6);
+
+  t.erase(a);
+  REQUIRE_THROWS(copy.data());
+  t.insert(7LL);
+  t.insert(8LL);
+  REQUIRE_THROWS(copy.data());
+  REQUIRE_THROWS(assigned.insert(1LL));
+  REQUIRE(t.size() == 2);
+
+  auto other = t.insert(9LL);
+  REQUIRE_THROWS(t.find(7LL).erase(other));
+}
+
+
+TEST_CASE("stats", "[dstree]")
+{
+  dstree t;
+  for (int64_t i = 0; i < 10; ++i)
+    t.insert(i).insert("abc");
+  t.erase(t.find(3LL));
+
+  auto s = t.stats();
+  REQUIRE(s.nodes.used == 19);
+  REQUIRE(s.nodes.capacity >= s.nodes.used);
+  REQUIRE(s.childs.used == 18);
+  REQUIRE(s.wasted_childs == s.allocated_childs - 18);
+  REQUIRE(s.strings.used == 9 * 4);
+  REQUIRE(s.dead_string_bytes == 4);
+  REQUIRE(s.total_bytes == t.serialize(nullptr, 0));
+
+  dstree::reset_instrumentation();
+  t.find(1LL);
+  uint64_t finds = ~0ULL;
+  dstree::export_instrumentation([&](const dstree::operation_stats& op) {
+    if (op.name == std::string("find"))
+      finds = op.count;
+  });
+#ifdef DSTREE_INSTRUMENTATION
+  REQUIRE(finds == 1);
+#else
+  REQUIRE(finds == 0);
+#endif
+}
+
+
+namespace {
+std::string label(dstree& t)
+{
+  std::string res;
+  std::visit(
+    [&](const auto& v) {
+      if constexpr (std::is_same_v<std::decay_t<decltype(v)>, const char*>)
+        res += v;
+      else
+        res += std::to_string(v);
+    },
+    t.data());
+  return res;
+}
+
+std::string dump(dstree& t)
+{
+  std::string res = "(" + label(t);
+  t.for_each_child([&](dstree& child) { res += dump(child); });
+  return res + ")";
+}
+
+// Same as dump, in the order walk visits the nodes
+std::string dump_walk(dstree& t)
+{
+  std::string res;
+  size_t open = 0;
+  t.walk([&](dstree& node, size_t depth) {
+    for (; open > depth; --open)
+      res += ")";
+    res += "(" + label(node);
+    ++open;
+    return true;
+  });
+  return res + std::string(open, ')');
+}
+
+std::vector<uint8_t> serialized(dstree& t)
+{
+  std::vector<uint8_t> vec(t.serialize(nullptr, 0));
+  t.serialize(vec.data(), vec.size());
+  return vec;
+}
+}
+
+TEST_CASE("released strings", "[dstree]")
+{
+  dstree t("root");
+  auto a = t.insert("aaaaaaaa");
+  auto b = t.insert("bbbbbbbb");
+  const auto capacity = t.stats().strings.capacity;
+  t.erase(a);
+  REQUIRE(t.stats().dead_string_bytes == 9);
+  // Only the table of released extents is added, with one extent in it
+  REQUIRE(t.stats().extra_tables_bytes == 8 + 16);
+  t.insert("cccc");
+  t.insert("ddd");
+  REQUIRE(t.stats().strings.capacity == capacity);
+  REQUIRE(t.stats().dead_string_bytes == 0);
+
+  // Neighbouring released strings merge into one extent
+  b.set_data("x");
+  t.erase(t.find("cccc"));
+  t.erase(t.find("ddd"));
+  REQUIRE(t.stats().dead_string_bytes == 18);
+  t.insert("a string of 17 ch");
+  REQUIRE(t.stats().strings.capacity == capacity + 2);
+  REQUIRE(t.stats().dead_string_bytes == 0);
+  REQUIRE(dump(t) == "(root(a string of 17 ch)(x))");
+
+  t.erase(t.find("x"));
+  auto binary = serialized(t);
+  auto copy = dstree::deserialize(binary.data(), binary.size());
+  copy.insert("y");
+  REQUIRE(copy.stats().strings.capacity == capacity + 2);
+  REQUIRE(dump(copy) == "(root(a string of 17 ch)(y))");
+
+  dstree::batch batch(copy);
+  batch.erase(copy.find("y"));
+  batch.set_data(copy.find("a string of 17 ch"), "z");
+  batch.commit();
+  REQUIRE(copy.stats().dead_string_bytes == 18 + 2);
+  const auto committed = copy.stats().strings.capacity;
+  copy.insert("another string 17");
+  REQUIRE(copy.stats().strings.capacity == committed);
+  REQUIRE(dump(copy) == "(root(another string 17)(z))");
+}
+
+TEST_CASE("extract, graft and move subtrees", "[dstree]")
+{
+  dstree t(0LL);
+  auto a = t.insert("a");
+  a.insert(1LL).insert("x");
+  a.insert(2LL).insert(2.5);
+  a.find(1LL).insert(3LL);
+  t.insert("b").insert(4LL);
+
+  auto extracted = a.extract_subtree();
+  REQUIRE(dump(extracted) == dump(a));
+  REQUIRE(extracted.stats().nodes.used == 6);
+  REQUIRE(extracted.stats().dead_string_bytes == 0);
+
+  auto part = serialized(extracted);
+  dstree other(10LL);
+  other.insert(11LL);
+  auto grafted = other.find(11LL).graft(part.data(), part.size());
+  REQUIRE(dump(grafted) == dump(a));
+  REQUIRE(dump(other) == "(10(11" + dump(a) + "))");
+  grafted.find(2LL).insert(20LL);
+  other.insert(12LL);
+  REQUIRE(other.stats().nodes.used == 10);
+
+  t.find("b").move_subtree(a.find(1LL));
+  REQUIRE(dump(t) == "(0(a(2(2.500000)))(b(1(3)(x))(4)))");
+  REQUIRE_THROWS(a.find(2LL).move_subtree(a));
+  REQUIRE_THROWS(other.move_subtree(a));
+
+  auto self = serialized(t);
+  t.find("a").graft(self.data(), self.size());
+  REQUIRE(t.find("a").size() == 2);
+}
+
+TEST_CASE("subtree hashes", "[dstree]")
+{
+  dstree a(0LL), b(0LL);
+  a.enable_subtree_hashes();
+  a.insert("x").insert(1LL);
+  a.insert("y").insert(2LL).insert(2.5);
+  b.insert("y").insert(2LL).insert(2.5);
+  b.insert("x").insert(1LL);
+  REQUIRE(dstree::equal(a, b));
+  REQUIRE(a.subtree_hash() == b.subtree_hash());
+
+  a.find("y").find(2LL).insert(3LL);
+  a.find("x").set_data("z");
+  b.insert("w");
+  REQUIRE(!dstree::equal(a, b));
+
+  std::vector<std::string> changes;
+  dstree::diff(a, b, [&](dstree::diff_kind kind, dstree* l, dstree* r) {
+    if (kind == dstree::diff_kind::added)
+      changes.push_back("+" + dump(*r));
+    else if (kind == dstree::diff_kind::removed)
+      changes.push_back("-" + dump(*l));
+    else
+      changes.push_back(dump(*l) + "~" + dump(*r));
+  });
+  std::sort(changes.begin(), changes.end());
+  REQUIRE(changes ==
+          std::vector<std::string>{ "+(w)", "+(x(1))", "-(3)", "-(z(1))" });
+
+  // Applying the diff to the replica makes both trees equal again
+  a.find("y").find(2LL).erase(a.find("y").find(2LL).find(3LL));
+  a.find("z").set_data("x");
+  a.insert("w");
+  REQUIRE(dstree::equal(a, b));
+
+  auto binary = serialized(a);
+  auto view = dstree::deserialize(binary.data(), binary.size(),
+                                  dstree::owning_mode::non_owning);
+  REQUIRE(dstree::equal(view, b));
+  REQUIRE(serialized(view) == binary);
+
+  a.find("x").graft(binary.data(), binary.size());
+  a.find("y").move_subtree(a.find("w"));
+  REQUIRE(!dstree::equal(a, b));
+  REQUIRE(dstree::equal(a.find("x").find(0LL), view));
+  REQUIRE(dstree::equal(a.find("y").find("w"), b.find("w")));
+}
+
+TEST_CASE("ordered children", "[dstree]")
+{
+  dstree t;
+  t.insert("beta");
+  t.insert(2.5);
+  for (int64_t i = 10; i > 0; --i)
+    t.insert(i * 10);
+  t.insert("alpha");
+  t.insert("alpine");
+  t.insert(-1.0);
+  t.insert(50LL).insert(1LL);
+
+  REQUIRE(dump(t) ==
+          "(0(10)(20)(30)(40)(50)(50(1))(60)(70)(80)(90)(100)(-1.000000)"
+          "(2.500000)(alpha)(alpine)(beta))");
+
+  std::string range;
+  t.for_each_child_in_range(25LL, 60LL,
+                            [&](dstree& child) { range += dump(child); });
+  REQUIRE(range == "(30)(40)(50)(50(1))");
+
+  std::string prefixed;
+  t.for_each_child_with_prefix(
+    "alp", [&](dstree& child) { prefixed += dump(child); });
+  REQUIRE(prefixed == "(alpha)(alpine)");
+
+  REQUIRE(std::get<int64_t>(t.lower_bound(50LL)->data()) == 50);
+  REQUIRE(t.lower_bound(50LL)->size() == 0);
+  REQUIRE(std::get<int64_t>(t.upper_bound(50LL)->data()) == 60);
+  REQUIRE(std::get<double>(t.upper_bound(100LL)->data()) == -1.0);
+  REQUIRE(!t.upper_bound("beta"));
+
+  t.find(10LL).set_data(75LL);
+  t.find("beta").set_data(0.0);
+  REQUIRE(dump(t) ==
+          "(0(20)(30)(40)(50)(50(1))(60)(70)(75)(80)(90)(100)(-1.000000)"
+          "(0.000000)(2.500000)(alpha)(alpine))");
+  t.erase(t.find(75LL));
+  REQUIRE(std::get<int64_t>(t.lower_bound(71LL)->data()) == 80);
+  REQUIRE(std::get<int64_t>(t.find(100LL).data()) == 100);
+  REQUIRE_THROWS(t.find(10LL));
+}
+
+TEST_CASE("builder", "[dstree]")
+{
+  dstree::builder b(1LL);
+  b.open("b");
+  b.add(3LL);
+  b.open(2.5);
+  b.add("x");
+  b.close();
+  b.add(1LL);
+  b.close();
+  b.add("a");
+  REQUIRE(b.depth() == 0);
+  REQUIRE_THROWS(b.close());
+
+  auto t = b.finish();
+  REQUIRE(dump(t) == "(1(a)(b(1)(3)(2.500000(x))))");
+  REQUIRE(t.stats().nodes.used == 7);
+  REQUIRE(t.stats().wasted_childs == 0);
+
+  t.find("b").insert(2LL);
+  t.erase(t.find("a"));
+  REQUIRE(dump(t) == "(1(b(1)(2)(3)(2.500000(x))))");
+  auto empty = b.finish();
+  REQUIRE(dump(empty) == "(0)");
+}
+
+TEST_CASE("parallel build", "[dstree]")
+{
+  auto build = [](size_t part) {
+    dstree::builder b(static_cast<int64_t>(part));
+    for (int64_t i = 0; i < 50; ++i) {
+      b.open(i);
+      b.add(std::to_string(part * 100 + i).c_str());
+      b.close();
+    }
+    return b.finish();
+  };
+
+  dstree expected("root");
+  for (size_t part = 0; part < 8; ++part) {
+    auto t = build(part);
+    auto binary = serialized(t);
+    expected.graft(binary.data(), binary.size());
+  }
+
+  auto t = dstree::build_parallel("root", 8, build, 4);
+  REQUIRE(dstree::equal(t, expected));
+  REQUIRE(t.stats().nodes.used == 1 + 8 * 101);
+  REQUIRE(std::get<const char*>(t.find(3LL).find(7LL).find("307").data()) ==
+          std::string("307"));
+  size_t visited = 0;
+  t.walk([&](dstree&, size_t) {
+    ++visited;
+    return true;
+  });
+  REQUIRE(visited == 1 + 8 * 101);
+
+  // Parts with free slots and spare child capacity keep working after join
+  dstree a(1LL), b("b");
+  for (int64_t i = 0; i < 10; ++i)
+    a.insert(i).insert("x");
+  a.erase(a.find(4LL));
+  b.insert(2.5);
+  auto joined = dstree::join(0LL, { b, a }, 2);
+  auto copy = joined.replicate(std::pmr::get_default_resource());
+  REQUIRE(dump(joined) == dump(copy));
+  auto joined_a = joined.find(1LL);
+  REQUIRE(dump(joined_a) == dump(a));
+  joined.find(1LL).insert(4LL);
+  joined.find("b").insert("c");
+  REQUIRE(joined.find(1LL).find(4LL).data() == dstree::key(4LL));
+  REQUIRE(joined.stats().nodes.used == 1 + 19 + 2 + 2);
+
+  REQUIRE_THROWS(dstree::join(0LL, { a.find(1LL) }));
+  REQUIRE_THROWS(dstree::build_parallel(0LL, 4, [](size_t part) -> dstree {
+    if (part == 2)
+      throw std::runtime_error("part failed");
+    return dstree();
+  }));
+  auto empty = dstree::join(0LL, {});
+  REQUIRE(dump(empty) == "(0)");
+}
+
+TEST_CASE("preorder layout", "[dstree]")
+{
+  dstree t(0LL);
+  t.enable_global_index();
+  for (int64_t i = 0; i < 5; ++i)
+    t.insert(i);
+  for (int64_t i = 0; i < 5; ++i)
+    t.find(i).insert("x").insert(i * 10);
+  t.erase(t.find(2LL));
+  t.freeze(2);
+  auto before = dump(t);
+  auto handle = t.find(3LL);
+  auto last = t.find(4LL).find("x").find(40LL);
+  const auto slots = t.stats().nodes.capacity;
+
+  std::string walked;
+  auto walk = [&](dstree& node, size_t depth) {
+    walked += std::to_string(depth);
+    return !std::holds_alternative<const char*>(node.data());
+  };
+  t.walk(walk);
+  REQUIRE(walked == "012121212");
+
+  t.reorder();
+  REQUIRE(dump(t) == before);
+  REQUIRE_THROWS(handle.data());
+  REQUIRE(t.stats().nodes.used == 13);
+  REQUIRE(t.stats().nodes.capacity == slots);
+  REQUIRE(t.find_all_global("x").size() == 4);
+  REQUIRE(std::get<int64_t>(t.find(4LL).find("x").find(40LL).data()) == 40);
+
+  walked.clear();
+  t.walk(walk);
+  REQUIRE(walked == "012121212");
+  walked.clear();
+  t.find(1LL).walk([&](dstree& node, size_t depth) {
+    walked += dump(node) + std::to_string(depth);
+    return true;
+  });
+  REQUIRE(walked == "(1(x(10)))0(x(10))1(10)2");
+
+  auto binary = serialized(t);
+  auto view = dstree::deserialize(binary.data(), binary.size(),
+                                  dstree::owning_mode::non_owning);
+  size_t n = 0;
+  view.walk([&](dstree&, size_t) { return ++n, true; });
+  REQUIRE(n == 13);
+
+  t.find(1LL).insert(5LL);
+  n = 0;
+  t.walk([&](dstree&, size_t) { return ++n, true; });
+  REQUIRE(n == 14);
+
+  // Slots past the compacted nodes are reused without reviving handles
+  for (int64_t i = 0; i < 20; ++i)
+    t.find(0LL).insert(i);
+  REQUIRE_THROWS(last.data());
+}
+
+TEST_CASE("walk follows key order", "[dstree]")
+{
+  dstree::builder b(0LL);
+  b.add(3LL);
+  b.open(1LL);
+  b.add("y");
+  b.add("x");
+  b.close();
+  b.add(2LL);
+  auto built = b.finish();
+  REQUIRE(dump(built) == "(0(1(x)(y))(2)(3))");
+  REQUIRE(dump_walk(built) == dump(built));
+
+  dstree::builder c(5LL);
+  c.add(6LL);
+  auto part = c.finish();
+  auto joined = dstree::join(0LL, { part, built });
+  REQUIRE(dump(joined) == "(0(0(1(x)(y))(2)(3))(5(6)))");
+  REQUIRE(dump_walk(joined) == dump(joined));
+
+  built.find(1LL).set_data(10LL);
+  REQUIRE(dump(built) == "(0(2)(3)(10(x)(y)))");
+  REQUIRE(dump_walk(built) == dump(built));
+  joined.find(0LL).find(3LL).set_data(-1LL);
+  REQUIRE(dump_walk(joined) == dump(joined));
+}
+
+TEST_CASE("order statistics", "[dstree]")
+{
+  auto check_sizes = [](dstree& t) {
+    t.walk([](dstree& node, size_t) {
+      size_t n = 0;
+      node.walk([&](dstree&, size_t) { return ++n, true; });
+      REQUIRE(node.subtree_size() == n);
+      return true;
+    });
+  };
+
+  dstree t(0LL);
+  for (int64_t i = 0; i < 20; ++i) {
+    auto child = t.insert(i * 2);
+    for (int64_t j = 0; j < i % 4; ++j)
+      child.insert(j).insert("leaf");
+  }
+  REQUIRE(t.size() == 20);
+  REQUIRE(t.subtree_size() == 1 + 20 + 2 * 30);
+  REQUIRE(t.find(6LL).subtree_size() == 7);
+  check_sizes(t);
+
+  t.erase(t.find(6LL));
+  t.find(2LL).move_subtree(t.find(4LL).find(1LL));
+  auto part = t.find(10LL).extract_subtree();
+  auto binary = serialized(part);
+  t.find(8LL).graft(binary.data(), binary.size());
+  dstree::batch b(t);
+  auto a = b.insert(t, "a");
+  b.insert(a, 1LL);
+  b.erase(t.find(14LL));
+  b.commit();
+  REQUIRE(t.subtree_size() == 81 - 7 + 3 + 2 - 7);
+  check_sizes(t);
+
+  REQUIRE(std::get<int64_t>(t.nth_child(0)->data()) == 0);
+  REQUIRE(std::get<int64_t>(t.nth_child(3)->data()) == 8);
+  REQUIRE(std::get<const char*>(t.nth_child(18)->data()) == std::string("a"));
+  REQUIRE(!t.nth_child(19));
+  REQUIRE(t.rank(-1LL) == 0);
+  REQUIRE(t.rank(8LL) == 3);
+  REQUIRE(t.rank(9LL) == 4);
+  REQUIRE(t.rank("a") == 18);
+  REQUIRE(t.rank("b") == 19);
+
+  std::vector<int64_t> page;
+  t.for_each_child_page(5, 3, [&](dstree& child) {
+    page.push_back(std::get<int64_t>(child.data()));
+  });
+  REQUIRE(page == std::vector<int64_t>{ 12, 16, 18 });
+  page.clear();
+  t.for_each_child_page(16, 2, [&](dstree& child) {
+    page.push_back(std::get<int64_t>(child.data()));
+  });
+  REQUIRE(page == std::vector<int64_t>{ 36, 38 });
+  t.for_each_child_page(30, 10, [&](dstree&) { FAIL(); });
+
+  // Images saved without subtree sizes are counted on load or walked
+  binary = serialized(t);
+  binary[offsetof(dstree_::header, flags)] &=
+    ~(dstree_::header::preorder_flag | dstree_::header::subtree_sizes_flag);
+  auto view = dstree::deserialize(binary.data(), binary.size(),
+                                  dstree::owning_mode::non_owning);
+  REQUIRE(view.subtree_size() == t.subtree_size());
+  auto loaded = dstree::deserialize(binary.data(), binary.size());
+  check_sizes(loaded);
+
+  t.clear();
+  REQUIRE(t.subtree_size() == 1);
+  t.insert(1LL);
+  REQUIRE(t.subtree_size() == 2);
+  t.reorder();
+  REQUIRE(t.subtree_size() == 2);
+}
+
+TEST_CASE("batch", "[dstree]")
+{
+  dstree t(0LL);
+  t.enable_global_index();
+  t.enable_subtree_hashes();
+  for (int64_t i = 0; i < 4; ++i)
+    t.insert(i * 10).insert("leaf");
+  t.freeze(2);
+  auto hash = t.subtree_hash();
+  auto kept = t.find(10LL);
+
+  dstree::batch b(t);
+  auto a = b.insert(t, "a");
+  b.insert(a, 1LL);
+  b.insert(a, "z");
+  b.insert(t.find(10LL), 5LL);
+  b.erase(t.find(20LL));
+  b.erase(t.find(20LL).find("leaf"));
+  b.set_data(t.find(30LL), 15LL);
+  b.set_data(t.find(0LL).find("leaf"), "b");
+  for (int64_t i = 0; i < 100; ++i)
+    b.insert(t.find(0LL), 100 - i);
+  REQUIRE(b.size() == 108);
+  REQUIRE(dump(t) == "(0(0(leaf))(10(leaf))(20(leaf))(30(leaf)))");
+
+  auto inserted = b.commit();
+  REQUIRE(inserted.size() == 104);
+  REQUIRE(b.size() == 0);
+  REQUIRE(dump(inserted[0]) == "(a(1)(z))");
+  REQUIRE(std::get<int64_t>(inserted[4].data()) == 100);
+  REQUIRE(std::get<int64_t>(kept.find(5LL).data()) == 5);
+  REQUIRE_THROWS(t.find(20LL));
+  REQUIRE(std::get<const char*>(t.find(15LL).find("leaf").data()) ==
+          std::string("leaf"));
+  REQUIRE(t.find(0LL).size() == 101);
+  REQUIRE(std::get<int64_t>(t.find(0LL).lower_bound(0LL)->data()) == 1);
+  REQUIRE(std::get<const char*>(t.find(0LL).upper_bound(100LL)->data()) ==
+          std::string("b"));
+  REQUIRE(t.find_all_global("leaf").size() == 2);
+  REQUIRE(t.find_all_global("b").size() == 1);
+  REQUIRE(t.subtree_hash() != hash);
+
+  dstree expected(0LL);
+  auto e0 = expected.insert(0LL);
+  e0.insert("b");
+  for (int64_t i = 1; i <= 100; ++i)
+    e0.insert(i);
+  expected.insert(10LL).insert("leaf");
+  expected.find(10LL).insert(5LL);
+  expected.insert(15LL).insert("leaf");
+  expected.insert("a").insert(1LL);
+  expected.find("a").insert("z");
+  REQUIRE(dstree::equal(t, expected));
+  REQUIRE(dump(t) == dump(expected));
+
+  // Failed commits leave the tree untouched
+  auto before = serialized(t);
+  b.insert(t.find(10LL), 1LL);
+  b.erase(t.find(10LL));
+  REQUIRE_THROWS(b.commit());
+  REQUIRE(b.size() == 2);
+  b.rollback();
+  b.erase(t);
+  REQUIRE_THROWS(b.commit());
+  REQUIRE(serialized(t) == before);
+  b.rollback();
+
+  auto stale = t.find(15LL);
+  b.set_data(stale, 1LL);
+  t.erase(stale);
+  REQUIRE_THROWS(b.commit());
+  REQUIRE_THROWS(b.set_data(stale, 1LL));
+  b.rollback();
+  REQUIRE(b.commit().empty());
+}
+
+TEST_CASE("find many", "[dstree]")
+{
+  dstree t(0LL);
+  for (int64_t i = 0; i < 300; ++i)
+    t.insert(i * 2).insert("x").insert(i);
+  t.insert("s").insert(0.5);
+  t.insert(std::nan(""));
+
+  std::vector<dstree::key> keys;
+  for (int64_t i = 0; i < 600; ++i)
+    keys.push_back(i);
+  keys.push_back("s");
+  keys.push_back(std::nan(""));
+  keys.push_back(2.0);
+
+  auto check = [&](dstree& tree) {
+    auto found = tree.find_many(keys);
+    REQUIRE(found.size() == keys.size());
+    for (int64_t i = 0; i < 600; ++i) {
+      REQUIRE(found[i].has_value() == (i % 2 == 0));
+      if (found[i])
+        REQUIRE(std::get<int64_t>(found[i]->data()) == i);
+    }
+    REQUIRE(found[600]);
+    REQUIRE(!found[601]);
+    REQUIRE(!found[602]);
+
+    auto paths = tree.find_paths({ { 10LL, "x", 5LL },
+                                   { 10LL, "x", 6LL },
+                                   { "s", 0.5 },
+                                   { 11LL, "x" },
+                                   {} });
+    REQUIRE(std::get<int64_t>(paths[0]->data()) == 5);
+    REQUIRE(!paths[1]);
+    REQUIRE(std::get<double>(paths[2]->data()) == 0.5);
+    REQUIRE(!paths[3]);
+    REQUIRE(std::get<int64_t>(paths[4]->data()) == 0);
+  };
+
+  check(t);
+  t.freeze(100);
+  check(t);
+}
+
+TEST_CASE("file-backed trees", "[dstree]")
+{
+  const auto dir =
+    std::filesystem::temp_directory_path() / "dstree_file_backed_test";
+  std::filesystem::remove_all(dir);
+  std::filesystem::create_directories(dir);
+  const auto path = (dir / "tree").string();
+  const auto log_path = path + ".log";
+
+  std::vector<uint8_t> expected;
+  {
+    auto t = dstree::open_file(path.data());
+    REQUIRE(std::filesystem::exists(path));
+    t.set_data("root");
+    auto a = t.insert("a");
+    a.insert(1LL).insert("x");
+    a.insert(2.5);
+    auto b = t.insert("b");
+    b.set_data("c");
+    b.move_subtree(a.find(1LL));
+    a.erase(a.find(2.5));
+
+    dstree::batch batch(t);
+    const auto n = batch.insert(t, 3LL);
+    batch.insert(n, "y");
+    batch.set_data(a, "z");
+    batch.commit();
+
+    dstree part("p");
+    part.insert(4LL);
+    auto bytes = serialized(part);
+    t.find(3LL).graft(bytes.data(), bytes.size());
+    t.enable_subtree_hashes();
+    t.freeze(2);
+
+    REQUIRE(dump(t) == "(root(3(p(4))(y))(c(1(x)))(z))");
+    expected = serialized(t);
+    REQUIRE(std::filesystem::file_size(log_path) > 0);
+  }
+
+  {
+    auto t = dstree::open_file(path.data());
+    REQUIRE(serialized(t) == expected);
+    t.checkpoint();
+    REQUIRE(std::filesystem::file_size(log_path) == 0);
+    t.insert(5LL);
+    expected = serialized(t);
+  }
+
+  // A torn record at the end of the log is dropped
+  {
+    std::ofstream(log_path, std::ios::binary | std::ios::app)
+      .write("\x10\0\0\0torn", 8);
+    auto t = dstree::open_file(path.data());
+    REQUIRE(serialized(t) == expected);
+    t.insert(6LL);
+  }
+
+  {
+    dstree::file_options options;
+    options.sync = false;
+    options.checkpoint_bytes = 256;
+    auto t = dstree::open_file(path.data(), options);
+    REQUIRE(dump(t) == "(root(3(p(4))(y))(5)(6)(c(1(x)))(z))");
+    for (int64_t i = 0; i < 100; ++i)
+      t.insert(i);
+    REQUIRE(std::filesystem::file_size(log_path) < 256);
+    expected = serialized(t);
+  }
+
+  {
+    auto t = dstree::open_file(path.data());
+    REQUIRE(serialized(t) == expected);
+  }
+  REQUIRE_THROWS(dstree().checkpoint());
+  std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("typed view", "[dstree]")
+{
+  dstree t;
+  for (int64_t i = 20; i > 0; i -= 2) {
+    auto user = t.insert(i);
+    user.insert("name").insert(double(i) / 4);
+    user.insert("age").insert(std::nan(""));
+  }
+
+  typed_view<int64_t, const char*, double> v(t);
+  REQUIRE(v.size() == 10);
+  REQUIRE(v.key(0) == 2);
+  REQUIRE(v.lower_bound(7) == 3);
+  REQUIRE(!v.find(7));
+  auto user = v.find(8);
+  REQUIRE(user);
+  REQUIRE(user->key(0) == std::string("age"));
+  REQUIRE(user->find("name")->key(0) == 2.0);
+  REQUIRE(std::isnan(user->find("age")->key(0)));
+  REQUIRE(!user->find("age")->find(std::nan("")));
+  REQUIRE(!user->find("email"));
+
+  // Only the listed levels are checked
+  typed_view<int64_t> shallow(t);
+  REQUIRE(shallow.child(9).size() == 2);
+
+  REQUIRE_THROWS(typed_view<const char*>(t));
+  t.insert("mixed");
+  REQUIRE_THROWS(typed_view<int64_t>(t));
+}
+
+TEST_CASE("string dictionary", "[dstree]")
+{
+  std::vector<uint8_t> tree_bytes, dictionary_bytes;
+  {
+    auto d = dstree::dictionary::create({ "name", "age", "email", "age" });
+    REQUIRE(d->size() == 3);
+    REQUIRE(dstree::dictionary::find(d->id()) == d);
+    REQUIRE(dstree::dictionary::create({ "email", "name", "age" }) == d);
+
+    dstree plain("root");
+    dstree t("root");
+    t.insert("name").insert("x");
+    plain.insert("name").insert("x");
+    t.use_dictionary(d);
+    REQUIRE(t.stats().dead_string_bytes == 0);
+    for (auto k : { "email", "zip", "age", "aa" }) {
+      t.insert(k).insert(1LL);
+      plain.insert(k).insert(1LL);
+    }
+    REQUIRE(dump(t) == "(root(aa(1))(age(1))(email(1))(name(x))(zip(1)))");
+    REQUIRE(t.stats().strings.used < plain.stats().strings.used);
+    REQUIRE(dstree::equal(t, plain));
+    REQUIRE(std::get<const char*>(t.find("email").data()) ==
+            std::string("email"));
+    REQUIRE(std::get<const char*>(t.lower_bound("b")->data()) ==
+            std::string("email"));
+    auto found = t.find_many({ "age", "zip", "nope" });
+    REQUIRE(found[0]);
+    REQUIRE(found[1]);
+    REQUIRE(!found[2]);
+    typed_view<const char*> v(t);
+    REQUIRE(v.key(v.lower_bound("b")) == std::string("email"));
+    REQUIRE(v.find("age")->size() == 1);
+
+    dstree::batch batch(t);
+    batch.insert(t, "name");
+    batch.commit();
+    REQUIRE(t.find("name").size() == 1);
+
+    auto part = serialized(t);
+    REQUIRE_THROWS(plain.graft(part.data(), part.size()));
+
+    auto copy = t.extract_subtree();
+    t = dstree();
+    REQUIRE(dump(copy) == "(root(aa(1))(age(1))(email(1))(name(x))(name)"
+                          "(zip(1)))");
+
+    tree_bytes = serialized(copy);
+    dictionary_bytes.resize(d->serialize(nullptr, 0));
+    d->serialize(dictionary_bytes.data(), dictionary_bytes.size());
+  }
+
+  REQUIRE_THROWS(dstree::deserialize(tree_bytes.data(), tree_bytes.size()));
+  auto d = dstree::dictionary::deserialize(dictionary_bytes.data(),
+                                           dictionary_bytes.size());
+  auto t = dstree::deserialize(tree_bytes.data(), tree_bytes.size());
+  REQUIRE(t.find("age").size() == 1);
+
+  t.use_dictionary(nullptr);
+  REQUIRE(t.stats().dead_string_bytes == 0);
+  const auto id = d->id();
+  d = nullptr;
+  REQUIRE(!dstree::dictionary::find(id));
+  REQUIRE(dump(t) == "(root(aa(1))(age(1))(email(1))(name(x))(name)(zip(1)))");
+}
+
+TEST_CASE("clear, shrink_to_fit and scratch trees", "[dstree]")
+{
+  dstree t("root");
+  t.enable_global_index();
+  for (int64_t i = 0; i < 100; ++i)
+    t.insert(i).insert("leaf");
+  auto child = t.find(5LL);
+  const auto capacity = t.stats().nodes.capacity;
+
+  t.clear();
+  REQUIRE(dump(t) == "(0)");
+  REQUIRE_THROWS(child.data());
+  REQUIRE(t.stats().nodes.capacity == capacity);
+  t.insert(5LL).insert("leaf");
+  REQUIRE_THROWS(child.data());
+  REQUIRE(t.find_all_global("leaf").size() == 1);
+  REQUIRE(dump(t) == "(0(5(leaf)))");
+
+  for (int64_t i = 0; i < 100; ++i)
+    t.insert(i * 10).set_data("some string value");
+  for (int64_t i = 0; i < 100; i += 2)
+    t.erase(t.find("some string value"));
+  auto kept = t.find(5LL).find("leaf");
+  const auto before = dump(t);
+  REQUIRE(t.stats().dead_string_bytes > 0);
+  const auto size = serialized(t).size();
+
+  t.shrink_to_fit();
+  REQUIRE(dump(t) == before);
+  REQUIRE(t.stats().dead_string_bytes == 0);
+  REQUIRE(t.stats().wasted_childs == 0);
+  REQUIRE(serialized(t).size() < size);
+  REQUIRE(std::get<const char*>(kept.data()) == std::string("leaf"));
+  t.find(5LL).insert(6LL);
+  REQUIRE(t.find_all_global("leaf").size() == 1);
+
+  dstree::reserve_scratch(2, 64 * 1024);
+  for (int round = 0; round < 3; ++round) {
+    auto s = dstree::scratch(int64_t(round));
+    for (int64_t i = 0; i < 50; ++i)
+      s.insert(i).insert(i);
+    REQUIRE(s.size() == 50);
+    REQUIRE(std::get<int64_t>(s.data()) == round);
+  }
+}
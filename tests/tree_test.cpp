@@ -1,9 +1,11 @@
 #include "tree.hpp"
+#include <algorithm>
 #include <catch.hpp>
+#include <dstree/dstree.hpp>
 
 TEST_CASE("", "[tree]")
 {
-  std::vector<uint8_t> parent;
+  dstree_::buffer parent;
   dstree_::init_empty_tree(parent);
 
   REQUIRE(dstree_::create_node(parent) == 0);
@@ -41,4 +43,157 @@ TEST_CASE("", "[tree]")
     REQUIRE(begin[1].node_id == 4);
     REQUIRE(begin[2].node_id == 5);
   }
-}
\ No newline at end of file
+}
+TEST_CASE("upgrade", "[tree]")
+{
+  dstree_::buffer parent;
+  dstree_::init_empty_tree(parent);
+  dstree_::create_node(parent);
+  for (int64_t v : { 3, 1, 2, 1 })
+    dstree_::insert(parent, 0, dstree_::node_value(v));
+
+  // Version 1 trees keep children in node id order
+  auto [begin, end] = dstree_::get_valid_childs_range(parent.data(), 0);
+  std::sort(begin, end);
+  reinterpret_cast<dstree_::header*>(parent.data())->version = 1;
+  REQUIRE(!dstree_::childs_ordered(parent.data()));
+
+  dstree_::upgrade(parent.data());
+  REQUIRE(dstree_::childs_ordered(parent.data()));
+  std::tie(begin, end) = dstree_::get_valid_childs_range(parent.data(), 0);
+  REQUIRE(end - begin == 4);
+  REQUIRE(begin[0].node_id == 2);
+  REQUIRE(begin[1].node_id == 4);
+  REQUIRE(begin[2].node_id == 3);
+  REQUIRE(begin[3].node_id == 1);
+}
+
+TEST_CASE("older versions", "[tree]")
+{
+  dstree_::buffer parent;
+  dstree_::init_empty_tree(parent);
+  dstree_::create_node(parent);
+  for (int64_t v : { 3, 1, 2, 1 })
+    dstree_::insert(parent, 0, dstree_::node_value(v));
+  dstree_::insert(parent, 3, dstree_::node_value(int64_t(5)));
+
+  // Version 1 images have children in id order and no subtree sizes
+  auto [begin, end] = dstree_::get_valid_childs_range(parent.data(), 0);
+  std::sort(begin, end);
+  auto h = reinterpret_cast<dstree_::header*>(parent.data());
+  h->version = 1;
+  h->flags = 0;
+  std::vector<uint8_t> image(parent.begin(), parent.end());
+
+  auto view = dstree::deserialize(image.data(), image.size(),
+                                  dstree::owning_mode::non_owning);
+  REQUIRE(view.subtree_size() == 6);
+  REQUIRE(std::get<int64_t>(view.lower_bound(2LL)->data()) == 2);
+  REQUIRE(std::get<int64_t>(view.upper_bound(1LL)->data()) == 2);
+  REQUIRE(view.rank(3LL) == 3);
+  REQUIRE(view.nth_child(1)->size() == 0);
+  REQUIRE(view.nth_child(2)->size() == 1);
+  std::vector<int64_t> keys;
+  view.for_each_child_in_range(1LL, 3LL, [&](dstree& child) {
+    keys.push_back(std::get<int64_t>(child.data()));
+  });
+  REQUIRE(keys == std::vector<int64_t>{ 1, 1, 2 });
+  REQUIRE(std::vector<uint8_t>(parent.begin(), parent.end()) == image);
+
+  auto owned = dstree::deserialize(image.data(), image.size());
+  REQUIRE(owned.find(2LL).subtree_size() == 2);
+  owned.find(2LL).insert(6LL);
+  REQUIRE(owned.subtree_size() == 7);
+
+  // Owned copies of a view are upgraded as well
+  auto replica = view.replicate(std::pmr::get_default_resource());
+  replica.insert(0LL);
+  REQUIRE(std::get<int64_t>(replica.nth_child(0)->data()) == 0);
+  REQUIRE(replica.rank(2LL) == 3);
+  auto extracted = view.extract_subtree();
+  extracted.insert(4LL);
+  REQUIRE(extracted.rank(4LL) == 4);
+  REQUIRE(extracted.nth_child(2)->size() == 1);
+  for (auto copy : { &replica, &extracted }) {
+    std::vector<uint8_t> copy_image(copy->serialize(nullptr, 0));
+    copy->serialize(copy_image.data(), copy_image.size());
+    REQUIRE(reinterpret_cast<dstree_::header*>(copy_image.data())->version ==
+            dstree_::header::current_version);
+    REQUIRE(dstree_::childs_ordered(copy_image.data()));
+  }
+
+  dstree::upgrade(image.data(), image.size());
+  auto data = image.data();
+  REQUIRE(reinterpret_cast<dstree_::header*>(data)->version ==
+          dstree_::header::current_version);
+  std::tie(begin, end) = dstree_::get_valid_childs_range(data, 0);
+  REQUIRE(begin[0].node_id == 2);
+  REQUIRE(begin[1].node_id == 4);
+  REQUIRE(begin[2].node_id == 3);
+  REQUIRE(begin[3].node_id == 1);
+  REQUIRE(dstree_::get_node(data, 0)->subtree_size == 6);
+  REQUIRE(dstree_::get_node(data, 3)->subtree_size == 2);
+
+  // Unknown versions and truncated images are rejected
+  reinterpret_cast<dstree_::header*>(data)->version =
+    dstree_::header::current_version + 1;
+  REQUIRE_THROWS(dstree::deserialize(data, image.size()));
+  reinterpret_cast<dstree_::header*>(data)->version = 0;
+  REQUIRE_THROWS(dstree::upgrade(data, image.size()));
+  reinterpret_cast<dstree_::header*>(data)->version =
+    dstree_::header::current_version;
+  REQUIRE_NOTHROW(dstree_::check_image(data, image.size()));
+  REQUIRE_THROWS(
+    dstree_::check_image(data, dstree_::header::struct_size + 100));
+  REQUIRE_THROWS(dstree_::check_image(data, 16));
+}
+
+TEST_CASE("corrupted images", "[tree]")
+{
+  dstree_::buffer parent;
+  dstree_::init_empty_tree(parent);
+  dstree_::create_node(parent);
+  const auto a = dstree_::insert(parent, 0, dstree_::node_value(int64_t(1)));
+  const auto b =
+    dstree_::insert(parent, 0, dstree_::node_value("bb", &parent));
+  dstree_::insert(parent, a, dstree_::node_value(int64_t(2)));
+  const std::vector<uint8_t> image(parent.begin(), parent.end());
+  REQUIRE_NOTHROW(dstree_::check_image(image.data(), image.size()));
+
+  auto corrupt = [&](auto&& change) {
+    auto copy = image;
+    change(copy.data());
+    REQUIRE_THROWS(dstree_::check_image(copy.data(), copy.size()));
+    REQUIRE_THROWS(dstree::deserialize(copy.data(), copy.size()));
+  };
+  auto child_of = [](uint8_t* data, uint64_t id) {
+    return dstree_::get_valid_childs_range(data, id).first;
+  };
+  corrupt([&](uint8_t* data) { child_of(data, 0)->node_id = 1000; });
+  corrupt([&](uint8_t* data) { child_of(data, 0)->node_id = 0; });
+  corrupt([&](uint8_t* data) { child_of(data, a)->node_id = b; });
+  corrupt([&](uint8_t* data) {
+    dstree_::get_node(data, a)->child_nodes_begin = 1000;
+  });
+  corrupt([&](uint8_t* data) {
+    dstree_::get_node(data, a)->child_nodes_size = 100;
+  });
+  corrupt([&](uint8_t* data) { dstree_::get_node(data, b)->parent_node = a; });
+  corrupt([&](uint8_t* data) {
+    dstree_::get_node(data, b)->value.data.string_index = 1000;
+  });
+  corrupt([&](uint8_t* data) {
+    dstree_::get_node(data, 0)->subtree_size = 1000;
+  });
+  corrupt([&](uint8_t* data) {
+    reinterpret_cast<dstree_::header*>(data)->free_node_id = 1000;
+  });
+  // Nodes cut off from the root, here a node and its child pointing at each
+  // other, would never be reached by walks
+  corrupt([&](uint8_t* data) {
+    const auto c = child_of(data, a)->node_id;
+    dstree_::get_node(data, a)->parent_node = c;
+    dstree_::get_node(data, 0)->child_nodes_size = 1;
+    child_of(data, 0)->node_id = b;
+  });
+}